@@ -0,0 +1,373 @@
+/*
+ * cache - On-disk cache of the files extracted from OPK packages
+ *
+ * Files are keyed by the hash of the OPK's content and the hash of their
+ * path within the OPK. They are written to a temporary file, then renamed
+ * in place, so that concurrent clients only ever see complete files.
+ * The modification time of a file is bumped on each hit, and the least
+ * recently used files are evicted when the cache grows over its limit.
+ *
+ * Licensed under the GPLv2
+ */
+
+#include "cache.h"
+#include "xxhash.h"
+
+#include <errno.h>
+
+#ifdef _WIN32
+
+int cache_open(struct cache *c, const char *dir, uint64_t max_size,
+	       const char *opk_fn)
+{
+	return -ENOSYS;
+}
+
+int cache_lookup(const struct cache *c, const char *fn,
+		 void **data, size_t *size, int *fd)
+{
+	return -ENOENT;
+}
+
+void cache_release(void *data, size_t size)
+{
+}
+
+int cache_store(const struct cache *c, const char *fn,
+		const void *data, size_t size)
+{
+	return -ENOSYS;
+}
+
+int cache_writer_open(const struct cache *c, const char *fn,
+		      struct cache_writer *w)
+{
+	return -ENOSYS;
+}
+
+int cache_writer_write(struct cache_writer *w, const void *buf, size_t len)
+{
+	return -ENOSYS;
+}
+
+int cache_writer_commit(const struct cache *c, struct cache_writer *w)
+{
+	return -ENOSYS;
+}
+
+void cache_writer_abort(struct cache_writer *w)
+{
+}
+
+#else
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Temporary files older than this were left behind by a dead client */
+#define STALE_TMP_SECS		3600
+
+struct cache_entry {
+	char name[64];
+	off_t size;
+	time_t mtime;
+};
+
+static int hash_file(const char *fn, uint64_t *hash)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(fn, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -errno;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -errno;
+
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	*hash = xxh64(map, st.st_size, 0);
+
+	munmap(map, st.st_size);
+
+	return 0;
+}
+
+static void cache_path(const struct cache *c, const char *fn,
+		       char *buf, size_t len)
+{
+	snprintf(buf, len, "%s/%016llx-%016llx", c->dir,
+		 (unsigned long long)c->opk_hash,
+		 (unsigned long long)xxh64(fn, strlen(fn), c->opk_hash));
+}
+
+static int mkdir_parents(char *path)
+{
+	char *ptr;
+
+	for (ptr = strchr(path + 1, '/'); ptr; ptr = strchr(ptr + 1, '/')) {
+		*ptr = '\0';
+		if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+			*ptr = '/';
+			return -errno;
+		}
+		*ptr = '/';
+	}
+
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+		return -errno;
+
+	return 0;
+}
+
+int cache_open(struct cache *c, const char *dir, uint64_t max_size,
+	       const char *opk_fn)
+{
+	const char *env;
+	int ret;
+
+	if (dir)
+		snprintf(c->dir, sizeof(c->dir), "%s", dir);
+	else if ((env = getenv("XDG_CACHE_HOME")) && *env)
+		snprintf(c->dir, sizeof(c->dir), "%s/odboot", env);
+	else if ((env = getenv("HOME")) && *env)
+		snprintf(c->dir, sizeof(c->dir), "%s/.cache/odboot", env);
+	else
+		return -ENOENT;
+
+	ret = mkdir_parents(c->dir);
+	if (ret)
+		return ret;
+
+	c->max_size = max_size;
+
+	return hash_file(opk_fn, &c->opk_hash);
+}
+
+int cache_lookup(const struct cache *c, const char *fn,
+		 void **data, size_t *size, int *fd_out)
+{
+	char path[CACHE_PATH_MAX];
+	struct stat st;
+	void *map = NULL;
+	int fd;
+
+	cache_path(c, fn, path, sizeof(path));
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -errno;
+	}
+
+	if (st.st_size) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			close(fd);
+			return -errno;
+		}
+
+		madvise(map, st.st_size, MADV_WILLNEED);
+	}
+
+	/* Mark the file as recently used */
+	futimens(fd, NULL);
+
+	if (fd_out)
+		*fd_out = fd;
+	else
+		close(fd);
+
+	*data = map;
+	*size = st.st_size;
+
+	return 0;
+}
+
+void cache_release(void *data, size_t size)
+{
+	if (size)
+		munmap(data, size);
+}
+
+static int cmp_entries(const void *a, const void *b)
+{
+	const struct cache_entry *ea = a, *eb = b;
+
+	return (ea->mtime > eb->mtime) - (ea->mtime < eb->mtime);
+}
+
+/* Evict the least recently used files, until the cache fits its limit */
+static void cache_evict(const struct cache *c, const char *keep)
+{
+	struct cache_entry *entries = NULL, *tmp;
+	size_t i, nb = 0, max_entries = 0;
+	char path[CACHE_PATH_MAX];
+	uint64_t total = 0;
+	struct dirent *d;
+	struct stat st;
+	time_t now;
+	int lock_fd;
+	DIR *dir;
+
+	snprintf(path, sizeof(path), "%s/.lock", c->dir);
+
+	lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (lock_fd < 0)
+		return;
+
+	/* Only one client evicts files at a time */
+	if (flock(lock_fd, LOCK_EX) < 0)
+		goto out_close_lock;
+
+	dir = opendir(c->dir);
+	if (!dir)
+		goto out_close_lock;
+
+	now = time(NULL);
+
+	while ((d = readdir(dir))) {
+		if (fstatat(dirfd(dir), d->d_name, &st, 0) < 0 ||
+		    !S_ISREG(st.st_mode))
+			continue;
+
+		if (!strncmp(d->d_name, ".tmp-", 5)) {
+			if (now - st.st_mtime > STALE_TMP_SECS)
+				unlinkat(dirfd(dir), d->d_name, 0);
+			continue;
+		}
+
+		if (d->d_name[0] == '.' || strlen(d->d_name) >= 64)
+			continue;
+
+		total += st.st_size;
+
+		if (!strcmp(d->d_name, keep))
+			continue;
+
+		if (nb == max_entries) {
+			max_entries = max_entries ? max_entries * 2 : 64;
+
+			tmp = realloc(entries, max_entries * sizeof(*entries));
+			if (!tmp)
+				goto out_closedir;
+
+			entries = tmp;
+		}
+
+		strcpy(entries[nb].name, d->d_name);
+		entries[nb].size = st.st_size;
+		entries[nb].mtime = st.st_mtime;
+		nb++;
+	}
+
+	qsort(entries, nb, sizeof(*entries), cmp_entries);
+
+	for (i = 0; i < nb && total > c->max_size; i++) {
+		if (!unlinkat(dirfd(dir), entries[i].name, 0))
+			total -= entries[i].size;
+	}
+
+out_closedir:
+	free(entries);
+	closedir(dir);
+out_close_lock:
+	close(lock_fd);
+}
+
+int cache_writer_open(const struct cache *c, const char *fn,
+		      struct cache_writer *w)
+{
+	cache_path(c, fn, w->path, sizeof(w->path));
+	snprintf(w->tmp, sizeof(w->tmp), "%s/.tmp-XXXXXX", c->dir);
+
+	w->fd = mkstemp(w->tmp);
+	if (w->fd < 0)
+		return -errno;
+
+	return 0;
+}
+
+int cache_writer_write(struct cache_writer *w, const void *buf, size_t len)
+{
+	const char *ptr = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(w->fd, ptr, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		ptr += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+int cache_writer_commit(const struct cache *c, struct cache_writer *w)
+{
+	int ret = 0;
+
+	fchmod(w->fd, 0644);
+
+	if (close(w->fd) < 0 || rename(w->tmp, w->path) < 0) {
+		ret = -errno;
+		unlink(w->tmp);
+		return ret;
+	}
+
+	cache_evict(c, strrchr(w->path, '/') + 1);
+
+	return 0;
+}
+
+void cache_writer_abort(struct cache_writer *w)
+{
+	close(w->fd);
+	unlink(w->tmp);
+}
+
+int cache_store(const struct cache *c, const char *fn,
+		const void *data, size_t size)
+{
+	struct cache_writer w;
+	int ret;
+
+	ret = cache_writer_open(c, fn, &w);
+	if (ret)
+		return ret;
+
+	ret = cache_writer_write(&w, data, size);
+	if (ret) {
+		cache_writer_abort(&w);
+		return ret;
+	}
+
+	return cache_writer_commit(c, &w);
+}
+
+#endif /* _WIN32 */
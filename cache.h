@@ -0,0 +1,50 @@
+/*
+ * cache - On-disk cache of the files extracted from OPK packages
+ *
+ * Licensed under the GPLv2
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_PATH_MAX		512
+
+struct cache {
+	char dir[CACHE_PATH_MAX / 2];
+	uint64_t max_size;
+
+	/* Hash of the content of the OPK file */
+	uint64_t opk_hash;
+};
+
+struct cache_writer {
+	int fd;
+	char tmp[CACHE_PATH_MAX];
+	char path[CACHE_PATH_MAX];
+};
+
+int cache_open(struct cache *c, const char *dir, uint64_t max_size,
+	       const char *opk_fn);
+
+/*
+ * Map a cached file in memory. Returns -ENOENT on a miss. If 'fd' is not
+ * NULL, the file is also left open for the caller to close.
+ */
+int cache_lookup(const struct cache *c, const char *fn,
+		 void **data, size_t *size, int *fd);
+void cache_release(void *data, size_t size);
+
+int cache_store(const struct cache *c, const char *fn,
+		const void *data, size_t size);
+
+/* Add a file to the cache while it is being read from the OPK */
+int cache_writer_open(const struct cache *c, const char *fn,
+		      struct cache_writer *w);
+int cache_writer_write(struct cache_writer *w, const void *buf, size_t len);
+int cache_writer_commit(const struct cache *c, struct cache_writer *w);
+void cache_writer_abort(struct cache_writer *w);
+
+#endif /* CACHE_H */
@@ -0,0 +1,19 @@
+/*
+ * crc32c - CRC32C (Castagnoli) checksum, with hardware acceleration
+ *
+ * Licensed under the GPLv2
+ */
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Update a running CRC32C with 'len' more bytes. Start with a CRC of 0;
+ * the result of each call can be passed back in to continue the digest.
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+#endif /* CRC32C_H */
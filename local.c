@@ -0,0 +1,503 @@
+/*
+ * local - Stand-in for the USB link, over UNIX or TCP sockets
+ *
+ * Licensed under the GPLv2
+ */
+
+#include "local.h"
+
+#include <errno.h>
+
+#ifdef _WIN32
+
+int local_addr_unix(struct local_addr *addr, const char *path)
+{
+	return -ENOSYS;
+}
+
+int local_addr_tcp(struct local_addr *addr, const char *str, bool listen)
+{
+	return -ENOSYS;
+}
+
+int local_connect(struct local_conn *c, const struct local_addr *addr)
+{
+	return -ENOSYS;
+}
+
+void local_disconnect(struct local_conn *c)
+{
+}
+
+int local_control(struct local_conn *c, uint8_t request_type, uint8_t request,
+		  uint16_t value, uint16_t index, void *data, uint16_t length)
+{
+	return -ENOSYS;
+}
+
+int local_bulk_write(struct local_conn *c, unsigned int ep,
+		     const void *buf, size_t len)
+{
+	return -ENOSYS;
+}
+
+int local_bulk_sendfile(struct local_conn *c, unsigned int ep,
+			int fd, off_t offset, size_t len)
+{
+	return -ENOSYS;
+}
+
+int local_listen(const struct local_addr *addr)
+{
+	return -ENOSYS;
+}
+
+void local_unlisten(int fd, const struct local_addr *addr)
+{
+}
+
+int local_accept(int listen_fd, unsigned int nb_eps,
+		 int *ctrl_fd, int *ep_fds)
+{
+	return -ENOSYS;
+}
+
+#else
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+int local_read_all(int fd, void *buf, size_t len)
+{
+	char *ptr = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = read(fd, ptr, len);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		if (!ret)
+			return -EPIPE;
+
+		ptr += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+int local_write_all(int fd, const void *buf, size_t len)
+{
+	const char *ptr = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = send(fd, ptr, len, MSG_NOSIGNAL);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		ptr += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+int local_addr_unix(struct local_addr *addr, const char *path)
+{
+	struct sockaddr_un *sun = (struct sockaddr_un *)&addr->ss;
+
+	if (strlen(path) >= sizeof(sun->sun_path))
+		return -ENAMETOOLONG;
+
+	memset(addr, 0, sizeof(*addr));
+	sun->sun_family = AF_UNIX;
+	strcpy(sun->sun_path, path);
+	addr->len = sizeof(*sun);
+
+	return 0;
+}
+
+int local_addr_tcp(struct local_addr *addr, const char *str, bool listen)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	};
+	const char *host = str, *port = LOCAL_TCP_PORT;
+	struct addrinfo *res;
+	char buf[256], *sep;
+	int ret;
+
+	if (strlen(str) >= sizeof(buf))
+		return -ENAMETOOLONG;
+
+	strcpy(buf, str);
+
+	if (buf[0] == '[') {
+		/* IPv6 address, with an optional port after the brackets */
+		sep = strchr(buf, ']');
+		if (!sep)
+			return -EINVAL;
+
+		*sep++ = '\0';
+		host = buf + 1;
+
+		if (*sep == ':')
+			port = sep + 1;
+		else if (*sep)
+			return -EINVAL;
+	} else {
+		host = buf;
+
+		sep = strrchr(buf, ':');
+		if (sep) {
+			*sep = '\0';
+			port = sep + 1;
+		} else if (listen) {
+			/* There is nothing but the port to listen on */
+			host = "";
+			port = buf;
+		}
+	}
+
+	/*
+	 * Nothing authenticates the clients, so only listen on all the
+	 * interfaces when asked to, with 0.0.0.0 or [::].
+	 */
+	if (!*host)
+		host = listen ? "127.0.0.1" : NULL;
+
+	ret = getaddrinfo(host, port, &hints, &res);
+	if (ret)
+		return ret == EAI_SYSTEM ? -errno : -EADDRNOTAVAIL;
+
+	memset(addr, 0, sizeof(*addr));
+	memcpy(&addr->ss, res->ai_addr, res->ai_addrlen);
+	addr->len = res->ai_addrlen;
+
+	freeaddrinfo(res);
+
+	return 0;
+}
+
+static void local_setup_socket(int fd)
+{
+	int one = 1;
+
+	/* Requests and extent headers are small, and latency matters */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static int local_open(const struct local_addr *addr,
+		      const struct local_hello *hello)
+{
+	int fd, ret;
+
+	fd = socket(addr->ss.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -errno;
+
+	if (addr->ss.ss_family != AF_UNIX)
+		local_setup_socket(fd);
+
+	if (connect(fd, (struct sockaddr *)&addr->ss, addr->len) == -1) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+
+	ret = local_write_all(fd, hello, sizeof(*hello));
+	if (ret) {
+		close(fd);
+		return ret;
+	}
+
+	return fd;
+}
+
+int local_connect(struct local_conn *c, const struct local_addr *addr)
+{
+	struct local_hello hello = { 0 };
+	unsigned int nb_eps;
+	int ret;
+
+	c->nb_eps = 0;
+
+	c->ctrl_fd = local_open(addr, &hello);
+	if (c->ctrl_fd < 0)
+		return c->ctrl_fd;
+
+	ret = local_read_all(c->ctrl_fd, &hello, sizeof(hello));
+	if (ret)
+		goto err_disconnect;
+
+	nb_eps = hello.ep;
+	if (!nb_eps || nb_eps > LOCAL_MAX_EPS) {
+		ret = -EPROTO;
+		goto err_disconnect;
+	}
+
+	for (; c->nb_eps < nb_eps; c->nb_eps++) {
+		hello.ep = c->nb_eps + 1;
+
+		ret = local_open(addr, &hello);
+		if (ret < 0)
+			goto err_disconnect;
+
+		c->ep_fds[c->nb_eps] = ret;
+	}
+
+	pthread_mutex_init(&c->lock, NULL);
+
+	return 0;
+
+err_disconnect:
+	while (c->nb_eps--)
+		close(c->ep_fds[c->nb_eps]);
+	close(c->ctrl_fd);
+	return ret;
+}
+
+void local_disconnect(struct local_conn *c)
+{
+	unsigned int i;
+
+	for (i = 0; i < c->nb_eps; i++)
+		close(c->ep_fds[i]);
+
+	close(c->ctrl_fd);
+	pthread_mutex_destroy(&c->lock);
+}
+
+/*
+ * Send a control request, and wait for its status. Returns the number of
+ * bytes received for IN requests, or the negative status of the request.
+ */
+int local_control(struct local_conn *c, uint8_t request_type, uint8_t request,
+		  uint16_t value, uint16_t index, void *data, uint16_t length)
+{
+	struct local_setup setup = {
+		.bRequestType = request_type,
+		.bRequest = request,
+		.wValue = value,
+		.wIndex = index,
+		.wLength = length,
+	};
+	struct local_status status;
+	uint32_t len, received;
+	char drain[256];
+	int ret;
+
+	/* Requests may come from several threads */
+	pthread_mutex_lock(&c->lock);
+
+	ret = local_write_all(c->ctrl_fd, &setup, sizeof(setup));
+	if (ret)
+		goto out_unlock;
+
+	ret = local_read_all(c->ctrl_fd, &status, sizeof(status));
+	if (ret)
+		goto out_unlock;
+
+	if (status.status < 0) {
+		ret = status.status;
+		goto out_unlock;
+	}
+
+	received = status.length < length ? status.length : length;
+
+	ret = local_read_all(c->ctrl_fd, data, received);
+	if (ret)
+		goto out_unlock;
+
+	/* Discard what does not fit in the buffer, like USB would */
+	for (status.length -= received; status.length; status.length -= len) {
+		len = status.length < sizeof(drain) ?
+			status.length : sizeof(drain);
+
+		ret = local_read_all(c->ctrl_fd, drain, len);
+		if (ret)
+			goto out_unlock;
+	}
+
+	ret = received;
+
+out_unlock:
+	pthread_mutex_unlock(&c->lock);
+	return ret;
+}
+
+int local_bulk_write(struct local_conn *c, unsigned int ep,
+		     const void *buf, size_t len)
+{
+	if (!ep || ep > c->nb_eps)
+		return -EINVAL;
+
+	return local_write_all(c->ep_fds[ep - 1], buf, len);
+}
+
+/*
+ * Send 'len' bytes of a file from 'offset', without copying them through
+ * userspace. Returns -ENOSYS if nothing could be sent that way.
+ */
+int local_bulk_sendfile(struct local_conn *c, unsigned int ep,
+			int fd, off_t offset, size_t len)
+{
+#ifdef __linux__
+	size_t left = len;
+	ssize_t ret;
+
+	if (!ep || ep > c->nb_eps)
+		return -EINVAL;
+
+	while (left) {
+		ret = sendfile(c->ep_fds[ep - 1], fd, &offset, left);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			if (left == len && (errno == EINVAL || errno == ENOSYS))
+				return -ENOSYS;
+			return -errno;
+		}
+
+		if (!ret)
+			return -EIO;
+
+		left -= ret;
+	}
+
+	return 0;
+#else
+	return -ENOSYS;
+#endif
+}
+
+int local_listen(const struct local_addr *addr)
+{
+	int fd, ret, one = 1;
+
+	fd = socket(addr->ss.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -errno;
+
+	if (addr->ss.ss_family == AF_UNIX) {
+		unlink(((struct sockaddr_un *)&addr->ss)->sun_path);
+	} else {
+		/* Inherited by the accepted connections */
+		local_setup_socket(fd);
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	}
+
+	if (bind(fd, (struct sockaddr *)&addr->ss, addr->len) == -1 ||
+	    listen(fd, LOCAL_MAX_EPS + 1) == -1) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+
+	return fd;
+}
+
+void local_unlisten(int fd, const struct local_addr *addr)
+{
+	if (addr->ss.ss_family == AF_UNIX)
+		unlink(((struct sockaddr_un *)&addr->ss)->sun_path);
+
+	close(fd);
+}
+
+/*
+ * Wait for a client to connect the control endpoint and all the bulk OUT
+ * endpoints. Connections that belong to another session are dropped;
+ * other clients stay in the backlog until the next call.
+ */
+int local_accept(int listen_fd, unsigned int nb_eps,
+		 int *ctrl_fd, int *ep_fds)
+{
+	static uint32_t nb_sessions;
+	unsigned int i, nb_connected = 0;
+	struct local_hello hello;
+	uint32_t session;
+	int conn_fd, ret;
+
+	if (nb_eps > LOCAL_MAX_EPS)
+		return -EINVAL;
+
+	*ctrl_fd = -1;
+	for (i = 0; i < nb_eps; i++)
+		ep_fds[i] = -1;
+
+	/* Only meant to tell sessions apart, not to authenticate them */
+	session = (uint32_t)time(NULL) ^ (uint32_t)getpid() << 16 ^
+		++nb_sessions;
+	if (!session)
+		session = 1;
+
+	while (nb_connected < nb_eps + 1) {
+		/* A signal interrupts the wait */
+		conn_fd = accept(listen_fd, NULL, NULL);
+		if (conn_fd == -1) {
+			ret = -errno;
+			goto err_close_conns;
+		}
+
+		ret = local_read_all(conn_fd, &hello, sizeof(hello));
+		if (ret) {
+			close(conn_fd);
+			continue;
+		}
+
+		if (!hello.ep && *ctrl_fd < 0) {
+			hello.session = session;
+			hello.ep = nb_eps;
+
+			ret = local_write_all(conn_fd, &hello, sizeof(hello));
+			if (ret) {
+				close(conn_fd);
+				continue;
+			}
+
+			*ctrl_fd = conn_fd;
+		} else if (*ctrl_fd >= 0 && hello.session == session &&
+			   hello.ep && hello.ep <= nb_eps &&
+			   ep_fds[hello.ep - 1] < 0) {
+			ep_fds[hello.ep - 1] = conn_fd;
+		} else {
+			close(conn_fd);
+			continue;
+		}
+
+		nb_connected++;
+	}
+
+	return 0;
+
+err_close_conns:
+	if (*ctrl_fd >= 0)
+		close(*ctrl_fd);
+	for (i = 0; i < nb_eps; i++) {
+		if (ep_fds[i] >= 0)
+			close(ep_fds[i]);
+	}
+	return ret;
+}
+
+#endif /* _WIN32 */
@@ -0,0 +1,94 @@
+/*
+ * local - Stand-in for the USB link, over UNIX or TCP sockets
+ *
+ * odbootd listens on a stream socket instead of FunctionFS. The client
+ * opens one connection for the control endpoint, then one per bulk OUT
+ * endpoint; each connection starts with a struct local_hello holding the
+ * number of the endpoint it stands for. The daemon answers the control
+ * connection with a struct local_hello holding the number of bulk OUT
+ * endpoints, and a session number that the client passes back on the
+ * connections of the bulk endpoints.
+ *
+ * Control requests are sent as the 8-byte USB setup packet. The daemon
+ * answers each one with a struct local_status, followed for IN requests by
+ * 'length' bytes of data.
+ *
+ * Licensed under the GPLv2
+ */
+
+#ifndef LOCAL_H
+#define LOCAL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#endif
+
+#define LOCAL_MAX_EPS		15
+#define LOCAL_TCP_PORT		"4770"
+
+struct local_addr {
+	struct sockaddr_storage ss;
+	socklen_t len;
+};
+
+struct local_hello {
+	uint32_t session;
+	uint8_t ep;
+} __attribute__((packed));
+
+struct local_setup {
+	uint8_t bRequestType;
+	uint8_t bRequest;
+	uint16_t wValue;
+	uint16_t wIndex;
+	uint16_t wLength;
+} __attribute__((packed));
+
+struct local_status {
+	int32_t status;
+	uint32_t length;
+} __attribute__((packed));
+
+struct local_conn {
+	pthread_mutex_t lock;
+	int ctrl_fd;
+	int ep_fds[LOCAL_MAX_EPS];
+	unsigned int nb_eps;
+};
+
+int local_addr_unix(struct local_addr *addr, const char *path);
+
+/*
+ * "host:port", "[host]:port" or "host". To listen, the host is optional
+ * and defaults to the IPv4 loopback address, and "port" is a port.
+ */
+int local_addr_tcp(struct local_addr *addr, const char *str, bool listen);
+
+/* Client side */
+int local_connect(struct local_conn *c, const struct local_addr *addr);
+void local_disconnect(struct local_conn *c);
+int local_control(struct local_conn *c, uint8_t request_type, uint8_t request,
+		  uint16_t value, uint16_t index, void *data, uint16_t length);
+int local_bulk_write(struct local_conn *c, unsigned int ep,
+		     const void *buf, size_t len);
+int local_bulk_sendfile(struct local_conn *c, unsigned int ep,
+			int fd, off_t offset, size_t len);
+
+/* Daemon side */
+int local_listen(const struct local_addr *addr);
+void local_unlisten(int fd, const struct local_addr *addr);
+int local_accept(int listen_fd, unsigned int nb_eps,
+		 int *ctrl_fd, int *ep_fds);
+
+int local_read_all(int fd, void *buf, size_t len);
+int local_write_all(int fd, const void *buf, size_t len);
+
+#endif /* LOCAL_H */
@@ -0,0 +1,201 @@
+/*
+ * lz4 - Small implementation of the LZ4 block format
+ *
+ * The compressor is a greedy single-probe matcher, which trades some ratio
+ * for speed. Its output can be decoded by any LZ4 implementation, and the
+ * decoder checks every length against the buffers.
+ *
+ * Licensed under the GPLv2
+ */
+
+#include "lz4.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define HASH_BITS		12
+#define MIN_MATCH		4
+#define LAST_LITERALS		5  /* The block ends with literals */
+#define MF_LIMIT		12 /* No match starts in the last bytes */
+#define MAX_OFFSET		65535
+#define SKIP_TRIGGER		6  /* Speed up over data that does not match */
+
+static inline uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+
+	return v;
+}
+
+static inline uint32_t hash32(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/* Room taken by a run of 'len' literals and its length bytes */
+static inline size_t literals_size(size_t len)
+{
+	return 1 + (len >= 15 ? (len - 15) / 255 + 1 : 0) + len;
+}
+
+static uint8_t * write_length(uint8_t *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+
+	*op++ = len;
+
+	return op;
+}
+
+size_t lz4_compress(const void *src, size_t len, void *dst, size_t max_len)
+{
+	const uint8_t *in = src, *ip = in, *anchor = in, *end = in + len;
+	const uint8_t *ref, *mp, *rp, *match_limit, *mf_limit;
+	uint8_t *op = dst, *op_end = op + max_len, *token;
+	uint32_t table[1 << HASH_BITS];
+	size_t lit_len, match_len;
+	uint32_t seq, h;
+
+	memset(table, 0, sizeof(table));
+
+	if (len > MF_LIMIT) {
+		mf_limit = end - MF_LIMIT;
+		match_limit = end - LAST_LITERALS;
+
+		while (ip < mf_limit) {
+			seq = read32(ip);
+			h = hash32(seq);
+			ref = in + table[h];
+			table[h] = ip - in;
+
+			if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != seq) {
+				ip += 1 + ((ip - anchor) >> SKIP_TRIGGER);
+				continue;
+			}
+
+			for (mp = ip + MIN_MATCH, rp = ref + MIN_MATCH;
+			     mp < match_limit && *mp == *rp; mp++, rp++);
+
+			lit_len = ip - anchor;
+			match_len = mp - ip - MIN_MATCH;
+
+			if (literals_size(lit_len) + 2 + match_len / 255 + 1 >
+			    (size_t)(op_end - op))
+				return 0;
+
+			token = op++;
+			*token = (lit_len >= 15 ? 15 : lit_len) << 4;
+			if (lit_len >= 15)
+				op = write_length(op, lit_len - 15);
+
+			memcpy(op, anchor, lit_len);
+			op += lit_len;
+
+			*op++ = (ip - ref) & 0xff;
+			*op++ = (ip - ref) >> 8;
+
+			*token |= match_len >= 15 ? 15 : match_len;
+			if (match_len >= 15)
+				op = write_length(op, match_len - 15);
+
+			ip = anchor = mp;
+		}
+	}
+
+	lit_len = end - anchor;
+
+	if (literals_size(lit_len) > (size_t)(op_end - op))
+		return 0;
+
+	token = op++;
+	*token = (lit_len >= 15 ? 15 : lit_len) << 4;
+	if (lit_len >= 15)
+		op = write_length(op, lit_len - 15);
+
+	memcpy(op, anchor, lit_len);
+	op += lit_len;
+
+	return op - (uint8_t *)dst;
+}
+
+/* Read the extra bytes of a length; returns false past the end */
+static bool read_length(const uint8_t **ip, const uint8_t *end, size_t *len)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= end)
+			return false;
+
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+
+	return true;
+}
+
+ssize_t lz4_decompress(const void *src, size_t len, void *dst, size_t max_len)
+{
+	const uint8_t *ip = src, *end = ip + len, *match;
+	uint8_t *op = dst, *op_end = op + max_len;
+	size_t lit_len, match_len, offset;
+	uint8_t token;
+
+	for (;;) {
+		if (ip >= end)
+			return -EINVAL;
+
+		token = *ip++;
+
+		lit_len = token >> 4;
+		if (lit_len == 15 && !read_length(&ip, end, &lit_len))
+			return -EINVAL;
+
+		if (lit_len > (size_t)(end - ip) ||
+		    lit_len > (size_t)(op_end - op))
+			return -EINVAL;
+
+		memcpy(op, ip, lit_len);
+		op += lit_len;
+		ip += lit_len;
+
+		/* The last sequence has no match */
+		if (ip == end)
+			break;
+
+		if (end - ip < 2)
+			return -EINVAL;
+
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+
+		if (!offset || offset > (size_t)(op - (uint8_t *)dst))
+			return -EINVAL;
+
+		match_len = token & 15;
+		if (match_len == 15 && !read_length(&ip, end, &match_len))
+			return -EINVAL;
+
+		match_len += MIN_MATCH;
+		if (match_len > (size_t)(op_end - op))
+			return -EINVAL;
+
+		match = op - offset;
+
+		/* Overlapping matches repeat the last 'offset' bytes */
+		if (offset >= match_len) {
+			memcpy(op, match, match_len);
+			op += match_len;
+		} else {
+			while (match_len--)
+				*op++ = *match++;
+		}
+	}
+
+	return op - (uint8_t *)dst;
+}
@@ -0,0 +1,25 @@
+/*
+ * lz4 - Small implementation of the LZ4 block format
+ *
+ * Licensed under the GPLv2
+ */
+
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Compress 'len' bytes into at most 'max_len' bytes. Returns the size of
+ * the compressed data, or 0 if it does not fit.
+ */
+size_t lz4_compress(const void *src, size_t len, void *dst, size_t max_len);
+
+/*
+ * Decompress a block into at most 'max_len' bytes. Returns the size of
+ * the decompressed data, or -EINVAL if the block is malformed.
+ */
+ssize_t lz4_decompress(const void *src, size_t len, void *dst, size_t max_len);
+
+#endif /* LZ4_H */
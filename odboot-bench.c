@@ -0,0 +1,408 @@
+/*
+ * odboot-bench - Throughput benchmark of odbootd over the local transport
+ *
+ * For each combination of receive mode, buffer size and file size, spawns
+ * odbootd serving a UNIX socket or a TCP port, uploads a file of synthetic
+ * data the way odboot-client does, and reports the throughput and the
+ * latency of each phase of the upload. The digest of the file is checked
+ * at the end.
+ *
+ * Licensed under the GPLv2
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+#include "local.h"
+
+#define CONNECT_TIMEOUT_MS	5000
+#define EXTENT_SIZE		(1024 * 1024)
+#define MAX_VALUES		16
+
+/* Requests to odbootd, as sent by odboot-client */
+enum custom_commands {
+	CMD_EXIT,
+	CMD_OPEN_FILE,
+	CMD_CLOSE_FILE,
+	CMD_GET_MANIFEST,
+	CMD_GET_DIGEST,
+};
+
+enum open_flags {
+	OPEN_FLAG_EXTENTS	= 1 << 0,
+};
+
+enum digest_flags {
+	DIGEST_VALID		= 1 << 0,
+};
+
+#define OPEN_ATTR(id, flags, stream) ((id) | (flags) << 8 | (stream) << 12)
+
+#define REQ_OUT			0x41 /* Vendor request to the interface */
+#define REQ_IN			0xc1
+
+#define ID_ROOTFS		0
+
+struct extent {
+	uint32_t offset;
+	uint32_t length;
+	uint32_t flags;
+} __attribute__((packed));
+
+struct digest {
+	uint32_t size;
+	uint32_t crc32c;
+	uint32_t flags;
+} __attribute__((packed));
+
+struct bench_result {
+	double connect_ms, open_ms, xfer_ms, close_ms, verify_ms;
+};
+
+static const char *odbootd_path = "./odbootd";
+static const char *tcp_addr;
+static bool direct_io;
+
+static double elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1e3 +
+		(now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static unsigned int parse_list(const char *str, unsigned int *values)
+{
+	unsigned int nb = 0;
+	char *end;
+
+	while (*str && nb < MAX_VALUES) {
+		values[nb++] = strtoul(str, &end, 0);
+		if (*end != ',')
+			break;
+		str = end + 1;
+	}
+
+	return nb;
+}
+
+static unsigned int parse_modes(char *str, const char **modes)
+{
+	unsigned int nb = 0;
+	char *tok;
+
+	for (tok = strtok(str, ","); tok && nb < MAX_VALUES;
+	     tok = strtok(NULL, ","))
+		modes[nb++] = tok;
+
+	return nb;
+}
+
+static pid_t spawn_odbootd(const char *sock, const char *root,
+			   const char *mode, unsigned int buf_kib)
+{
+	char buf_arg[16];
+	pid_t pid;
+	int fd;
+
+	snprintf(buf_arg, sizeof(buf_arg), "%u", buf_kib);
+
+	pid = fork();
+	if (pid)
+		return pid;
+
+	/* The progress output of odbootd would only add noise */
+	fd = open("/dev/null", O_WRONLY);
+	if (fd >= 0) {
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+	}
+
+	execl(odbootd_path, odbootd_path, tcp_addr ? "-t" : "-L",
+	      tcp_addr ? tcp_addr : sock, "-r", root, "-n", "1",
+	      "-m", mode, "-b", buf_arg, direct_io ? "-D" : NULL, NULL);
+	_exit(127);
+}
+
+static int bench_connect(struct local_conn *conn, const char *sock)
+{
+	struct local_addr addr;
+	struct timespec start;
+	int ret;
+
+	if (tcp_addr)
+		ret = local_addr_tcp(&addr, tcp_addr, false);
+	else
+		ret = local_addr_unix(&addr, sock);
+	if (ret)
+		return ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* Wait for odbootd to create its socket */
+	do {
+		ret = local_connect(conn, &addr);
+		if (ret != -ENOENT && ret != -ECONNREFUSED)
+			break;
+
+		usleep(1000);
+	} while (elapsed_ms(&start) < CONNECT_TIMEOUT_MS);
+
+	return ret;
+}
+
+static int bench_upload(struct local_conn *conn, const unsigned char *data,
+			uint32_t size, struct bench_result *res)
+{
+	struct extent extent = { 0 };
+	struct timespec start;
+	struct digest digest;
+	uint32_t offset, len, crc = 0;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	ret = local_control(conn, REQ_OUT, CMD_OPEN_FILE,
+			    OPEN_ATTR(ID_ROOTFS, OPEN_FLAG_EXTENTS, 0),
+			    0, NULL, 0);
+	if (ret)
+		return ret;
+
+	res->open_ms = elapsed_ms(&start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	ret = local_bulk_write(conn, 1, &size, sizeof(size));
+	if (ret)
+		return ret;
+
+	for (offset = 0; offset < size; offset += len) {
+		len = size - offset;
+		if (len > EXTENT_SIZE)
+			len = EXTENT_SIZE;
+
+		extent.offset = offset;
+		extent.length = len;
+
+		ret = local_bulk_write(conn, 1, &extent, sizeof(extent));
+		if (ret)
+			return ret;
+
+		ret = local_bulk_write(conn, 1, data, len);
+		if (ret)
+			return ret;
+
+		crc = crc32c(crc, data, len);
+	}
+
+	/* Terminate the list of extents */
+	extent.offset = 0;
+	extent.length = 0;
+
+	ret = local_bulk_write(conn, 1, &extent, sizeof(extent));
+	if (ret)
+		return ret;
+
+	res->xfer_ms = elapsed_ms(&start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* Returns once odbootd has written everything */
+	ret = local_control(conn, REQ_OUT, CMD_CLOSE_FILE,
+			    OPEN_ATTR(0, 0, 0), 0, NULL, 0);
+	if (ret)
+		return ret;
+
+	res->close_ms = elapsed_ms(&start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	ret = local_control(conn, REQ_IN, CMD_GET_DIGEST, ID_ROOTFS, 0,
+			    &digest, sizeof(digest));
+	if (ret < 0)
+		return ret;
+
+	res->verify_ms = elapsed_ms(&start);
+
+	if (ret != sizeof(digest) || !(digest.flags & DIGEST_VALID) ||
+	    digest.size != size || digest.crc32c != crc) {
+		fprintf(stderr, "Digest mismatch\n");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int bench_run(const char *root, const char *mode, unsigned int buf_kib,
+		     const unsigned char *data, uint32_t size,
+		     struct bench_result *res)
+{
+	struct local_conn conn;
+	struct timespec start;
+	char sock[256];
+	int ret, status;
+	pid_t pid;
+
+	snprintf(sock, sizeof(sock), "%s/odbootd.sock", root);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pid = spawn_odbootd(sock, root, mode, buf_kib);
+	if (pid < 0)
+		return -errno;
+
+	ret = bench_connect(&conn, sock);
+	if (ret) {
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+		return ret;
+	}
+
+	res->connect_ms = elapsed_ms(&start);
+
+	ret = bench_upload(&conn, data, size, res);
+	if (!ret)
+		ret = local_control(&conn, REQ_OUT, CMD_EXIT, 0, 0, NULL, 0);
+
+	local_disconnect(&conn);
+
+	if (ret)
+		kill(pid, SIGTERM);
+
+	waitpid(pid, &status, 0);
+
+	return ret;
+}
+
+static void usage(void)
+{
+	printf("Usage:\n\todboot-bench [options]\n"
+	       "\nOptions:\n"
+	       "\t-d <path>\tPath to the odbootd binary (default ./odbootd)\n"
+	       "\t-m <modes>\tReceive modes of odbootd (default copy,splice)\n"
+	       "\t-b <KiB,...>\tReceive buffer sizes (default 16,64,256)\n"
+	       "\t-s <MiB,...>\tFile sizes (default 1,16,64)\n"
+	       "\t-t <host:port>\tConnect over TCP instead of a UNIX socket\n"
+	       "\t-D\t\tWrite the files with direct I/O\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int buf_sizes[MAX_VALUES] = { 16, 64, 256 };
+	unsigned int file_sizes[MAX_VALUES] = { 1, 16, 64 };
+	const char *modes[MAX_VALUES] = { "copy", "splice" };
+	unsigned int nb_bufs = 3, nb_sizes = 3, nb_modes = 2;
+	unsigned int m, b, f, nb_failed = 0;
+	char root[] = "/tmp/odboot-bench.XXXXXX";
+	char path[sizeof(root) + 32];
+	struct bench_result res;
+	unsigned char *data;
+	uint64_t seed = 0x9e3779b97f4a7c15ull;
+	double secs;
+	size_t i;
+	int ret;
+
+	while ((ret = getopt(argc, argv, "d:m:b:s:t:D")) != -1) {
+		switch (ret) {
+		case 'd':
+			odbootd_path = optarg;
+			break;
+		case 'm':
+			nb_modes = parse_modes(optarg, modes);
+			break;
+		case 'b':
+			nb_bufs = parse_list(optarg, buf_sizes);
+			break;
+		case 's':
+			nb_sizes = parse_list(optarg, file_sizes);
+			break;
+		case 't':
+			tcp_addr = optarg;
+			break;
+		case 'D':
+			direct_io = true;
+			break;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!nb_modes || !nb_bufs || !nb_sizes) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	/* Incompressible data, so that no layer can take shortcuts */
+	data = malloc(EXTENT_SIZE);
+	if (!data)
+		return EXIT_FAILURE;
+
+	for (i = 0; i < EXTENT_SIZE; i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		data[i] = seed | 1; /* No zero pages */
+	}
+
+	if (!mkdtemp(root)) {
+		perror("Unable to create the work directory");
+		return EXIT_FAILURE;
+	}
+
+	snprintf(path, sizeof(path), "%s/boot", root);
+	mkdir(path, 0755);
+
+	printf("%-8s %8s %9s %11s %8s %9s %9s %10s %8s\n",
+	       "Mode", "Buf KiB", "Size MiB", "Connect ms", "Open ms",
+	       "Xfer ms", "Close ms", "Verify ms", "MB/s");
+
+	for (m = 0; m < nb_modes; m++) {
+		for (b = 0; b < nb_bufs; b++) {
+			for (f = 0; f < nb_sizes; f++) {
+				uint32_t size = file_sizes[f] * 1024 * 1024;
+
+				memset(&res, 0, sizeof(res));
+
+				ret = bench_run(root, modes[m], buf_sizes[b],
+						data, size, &res);
+				if (ret) {
+					printf("%-8s %8u %9u FAILED: %s\n",
+					       modes[m], buf_sizes[b],
+					       file_sizes[f], strerror(-ret));
+					nb_failed++;
+					continue;
+				}
+
+				secs = (res.xfer_ms + res.close_ms) / 1e3;
+
+				printf("%-8s %8u %9u %11.2f %8.2f %9.2f %9.2f %10.2f %8.1f\n",
+				       modes[m], buf_sizes[b], file_sizes[f],
+				       res.connect_ms, res.open_ms, res.xfer_ms,
+				       res.close_ms, res.verify_ms,
+				       secs > 0.0 ? size / secs / 1e6 : 0.0);
+			}
+		}
+	}
+
+	snprintf(path, sizeof(path), "%s/boot/rootfs.squashfs", root);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/boot", root);
+	rmdir(path);
+	rmdir(root);
+
+	free(data);
+
+	return nb_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
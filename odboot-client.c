@@ -1,14 +1,33 @@
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <libusb-1.0/libusb.h>
 #include <opk.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "cache.h"
+#include "crc32c.h"
+#include "local.h"
+#include "lz4.h"
+#include "profile.h"
+#include "trace.h"
+#include "xxhash.h"
+
 #ifdef _WIN32
 #include <math.h>
+#else
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 #endif
 
 #ifdef _WIN32
@@ -26,7 +45,36 @@ char *strndup( const char *s1, size_t n)
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
+/* What odbootd sends and receives is little-endian, both ways */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define LE32(x) __builtin_bswap32(x)
+#define LE64(x) __builtin_bswap64(x)
+#else
+#define LE32(x) (x)
+#define LE64(x) (x)
+#endif
+
 #define TIMEOUT_MS		10000
+#define RECONNECT_TIMEOUT_S	60
+#define RECONNECT_POLL_MS	50
+#define DEFAULT_CACHE_SIZE	(1024ull * 1024 * 1024)
+#define MAX_PREFETCH_THREADS	8
+
+#define DEFAULT_QUEUE_DEPTH	4
+#define MAX_QUEUE_DEPTH		32
+#define DEFAULT_CHUNK_SIZE	(1024 * 1024)
+#define MAX_STREAMS		4
+
+#define MANIFEST_TIMEOUT_MS	60000
+#define MANIFEST_PAGE_SIZE	4096
+#define DEFAULT_BLOCK_SIZE	(64 * 1024)
+#define MAX_EXTENT_SIZE		(1024 * 1024)
+#define SPARSE_PAGE_SIZE	4096
+#define STATS_INTERVAL_S	1
+#define CALIBRATION_SIZE	(16 * 1024 * 1024)
+#define MAX_RX_QUEUE_SIZE	(4 * 1024 * 1024) /* rx_buf_size x rx_depth */
+#define COMPRESS_PROBE_SIZE	(1024 * 1024)
+#define MAX_RESUMES		3
 
 extern const char __end_image, __start_image;
 
@@ -54,6 +102,45 @@ enum custom_commands {
 	CMD_EXIT,
 	CMD_OPEN_FILE,
 	CMD_CLOSE_FILE,
+	CMD_GET_MANIFEST,
+	CMD_GET_DIGEST,
+	CMD_GET_STATS,
+	CMD_SET_PARAM,
+	CMD_GET_FEATURES,
+	CMD_GET_RESUME,
+	CMD_OPEN_BATCH,
+	CMD_ABORT,
+};
+
+enum device_features {
+	FEATURE_LZ4		= 1 << 0,
+	FEATURE_BATCH		= 1 << 1,
+	FEATURE_SCRATCH		= 1 << 2,
+	FEATURE_ABORT		= 1 << 3,
+};
+
+/* Layout of wValue for CMD_OPEN_FILE, CMD_OPEN_BATCH and CMD_CLOSE_FILE */
+#define OPEN_ATTR(id, flags, stream) ((id) | (flags) << 8 | (stream) << 12)
+
+/* Layout of wValue for CMD_SET_PARAM */
+#define PARAM_ATTR(param, value) ((value) | (param) << 12)
+#define MAX_PARAM_VALUE		0xfff
+
+enum device_params {
+	PARAM_RX_BUF_SIZE,	/* KiB */
+	PARAM_RX_DEPTH,
+};
+
+enum open_flags {
+	OPEN_FLAG_EXTENTS	= 1 << 0,
+	OPEN_FLAG_KEEP		= 1 << 1,
+	OPEN_FLAG_LZ4		= 1 << 2,
+	OPEN_FLAG_RESUME	= 1 << 3,
+};
+
+enum extent_flags {
+	EXTENT_ZERO		= 1 << 0,
+	EXTENT_LZ4		= 1 << 1, /* Data is a 32-bit size and an LZ4 block */
 };
 
 enum file_id {
@@ -63,6 +150,264 @@ enum file_id {
 	ID_UBIBOOT,
 	ID_MININIT,
 	ID_MODULESFS,
+
+	NB_FILE_IDS,
+
+	/* Deleted by the device once received, for calibration uploads */
+	ID_SCRATCH = NB_FILE_IDS,
+};
+
+struct extent {
+	uint32_t offset;
+	uint32_t length;
+	uint32_t flags;
+} __attribute__((packed));
+
+/* Sent before each file of a batch, in place of its size */
+struct batch_entry {
+	uint32_t file_id;
+	uint32_t flags;
+	uint32_t size;
+} __attribute__((packed));
+
+#define BATCH_END		0xffffffff
+
+struct extent_writer {
+	struct xfer_queue *q;
+	unsigned char *run;
+	size_t run_offset, run_len;
+
+	/* File in memory that the runs point into, instead of being copied */
+	const unsigned char *src;
+	int src_fd;
+
+	size_t zero_offset, zero_len;
+	size_t sent, zeroed;
+
+	/* Runs are compressed until they turn out not to compress */
+	bool compress;
+	unsigned char *packed;
+	size_t probed, packed_in, packed_out;
+};
+
+struct manifest_header {
+	uint32_t file_size;
+	uint32_t block_size;
+	uint32_t nb_blocks;
+	uint32_t first_block;
+} __attribute__((packed));
+
+struct manifest {
+	uint32_t file_size, block_size, nb_blocks;
+	uint64_t *hashes;
+};
+
+enum digest_flags {
+	DIGEST_VALID		= 1 << 0,
+};
+
+/* Reply to CMD_GET_DIGEST: CRC32C of the file as received by the device */
+struct digest {
+	uint32_t size;
+	uint32_t crc32c;
+	uint32_t flags;
+} __attribute__((packed));
+
+/* Reply to CMD_GET_RESUME: what the device kept of an interrupted transfer */
+struct resume {
+	uint32_t file_size;
+	uint32_t offset;
+	uint32_t crc32c;	/* Of the data before 'offset' */
+} __attribute__((packed));
+
+enum stats_flags {
+	STATS_ACTIVE		= 1 << 0,
+};
+
+/* Reply to CMD_GET_STATS, one per stream: the upload as seen by odbootd */
+struct device_stats {
+	uint32_t flags;
+	uint32_t file_id;
+	uint32_t file_size;
+	uint32_t elapsed_ms;
+	uint64_t bytes;
+	uint64_t total_bytes;
+	uint32_t nb_chunks;
+	uint32_t max_chunk_us;
+	uint64_t chunk_us;
+	uint32_t nb_stalls;
+} __attribute__((packed));
+
+/* Link to odbootd: USB, or a local socket standing in for it */
+struct transport {
+	libusb_device_handle *hdl;
+	struct local_conn *local;
+
+	/* Bulk transfer parameters, or 0 for the global defaults */
+	unsigned int chunk_size, queue_depth;
+
+	/* Last parameters set, to set again after reconnecting */
+	struct profile xfer;
+
+	/* The device can decompress files opened with OPEN_FLAG_LZ4 */
+	bool compress;
+
+	/* The device can receive the files of a stream in one batch */
+	bool batch;
+
+	/* The device has a scratch file to upload to (ID_SCRATCH) */
+	bool scratch;
+
+	/* The device can stop the transfers of a lost link (CMD_ABORT) */
+	bool abort;
+
+	/* Bulk OUT endpoint of each stream, as found in the descriptors */
+	unsigned char endpoints[MAX_STREAMS];
+	unsigned int nb_streams;
+};
+
+struct xfer_slot {
+	struct xfer_queue *q;
+	struct libusb_transfer *xfer;
+	unsigned char *buf;
+	uint64_t start;
+};
+
+struct xfer_queue {
+	pthread_mutex_t lock;
+	const struct transport *t;
+	unsigned char endpoint;
+	struct xfer_slot slots[MAX_QUEUE_DEPTH];
+	struct xfer_slot *free_slots[MAX_QUEUE_DEPTH];
+	unsigned int nb_slots, nb_free;
+	unsigned int chunk_size;
+	int status;
+};
+
+/* A file extracted once, and shared read-only between all the sessions */
+struct artifact {
+	void *data;
+	size_t size;
+	int ret;
+
+	/* Memory-mapped from the cache or a local file, kept open */
+	bool mapped;
+	int fd;
+};
+
+/*
+ * Extracts the stage-2 files into the cache in the background, while the
+ * device boots. The uploads then map them from the cache.
+ */
+struct prefetch {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thds[MAX_PREFETCH_THREADS];
+	unsigned int nb_thds, next;
+	bool stop;
+
+	struct flash_params *params;
+
+	/* Set once the prefetch thread is done with the file */
+	bool ready[NB_FILE_IDS];
+};
+
+/* Everything needed to flash a device, shared between sessions */
+struct flash_params {
+	struct OPK *opk;
+	const char *boardname;
+	const struct board_group *group;
+	const struct board *board;
+
+	struct artifact stage1, dtb;
+	const unsigned char *kernel;
+	size_t kernel_size;
+
+	/* Extracts the stage-2 files into the cache ahead, or NULL */
+	struct prefetch *prefetch;
+};
+
+/* One per device being flashed */
+struct session {
+	pthread_t thd;
+	const struct flash_params *params;
+	libusb_device *dev;
+	uint8_t bus, ports[7];
+	int nb_ports;
+	char name[32];
+
+	/* Reconnection after CMD_START2 */
+	uint8_t address;
+	bool hotplug;
+	libusb_hotplug_callback_handle hotplug_cb;
+	libusb_device *new_dev;
+	int arrived;
+	double reconnect_secs;
+
+	const char *step;
+	size_t bytes;
+	double secs;
+	int ret;
+};
+
+/* Stage-2 files are taken from a shared list by one worker per stream */
+struct upload_ctx {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	const struct transport *t;
+	const struct flash_params *params;
+	unsigned int next, nb_running;
+	size_t bytes;
+	int status;
+
+	/* Files uploaded before the link was lost, one bit per file id */
+	unsigned int *done;
+};
+
+struct upload_worker {
+	struct upload_ctx *ctx;
+	pthread_t thd;
+	unsigned int stream;
+};
+
+struct opk_stream {
+	size_t size, offset;
+
+	/* Whole file extracted by libopk, when it cannot be streamed */
+	void *data;
+	bool shared, mapped;
+
+	/* Cache file that 'data' is mapped from, or -1 */
+	int file_fd;
+
+	/* Copy of the streamed file being added to the cache */
+	struct cache_writer cw;
+	bool caching;
+
+#ifndef _WIN32
+	pid_t pid;
+	int fd;
+#endif
+};
+
+/*
+ * Files queued on a stream after CMD_OPEN_BATCH, whose digests are checked
+ * once the device has written them all. Their streams are closed then too,
+ * as the queue may still be sending from their memory.
+ */
+struct batch {
+	struct xfer_queue q;
+	unsigned int stream;
+	bool open;
+
+	unsigned int nb_files;
+	struct {
+		enum file_id id;
+		uint32_t size, crc;
+	} files[NB_FILE_IDS];
+
+	unsigned int nb_streams;
+	struct opk_stream streams[NB_FILE_IDS];
 };
 
 static const char *files_to_upload[] = {
@@ -72,6 +417,20 @@ static const char *files_to_upload[] = {
 	[ID_MODULESFS] = "modules.squashfs",
 };
 
+static libusb_context *usb_ctx;
+static const char *opk_filename;
+static pthread_mutex_t opk_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int queue_depth = DEFAULT_QUEUE_DEPTH;
+static unsigned int chunk_size = DEFAULT_CHUNK_SIZE;
+static bool delta_updates;
+static bool all_devices;
+static bool calibrate_xfer, user_xfer_params;
+static bool force_compression;
+static char profile_path[PROFILE_PATH_MAX];
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cache cache;
+static bool use_cache = true;
+
 static const struct board gcw0_boards[] = {
 	{ "gcw0_proto", "v11_ddr2_256mb", "GCW-Zero Prototype (256 MiB)" },
 	{ "gcw0", "v20_mddr_512mb", "GCW-Zero" },
@@ -173,399 +532,3066 @@ static int cmd_get_info(libusb_device_handle *hdl)
 
 static int cmd_control(libusb_device_handle *hdl, uint32_t cmd, uint32_t attr)
 {
-	return libusb_control_transfer(hdl, LIBUSB_ENDPOINT_OUT |
+	uint64_t start = trace_begin();
+	int ret;
+
+	ret = libusb_control_transfer(hdl, LIBUSB_ENDPOINT_OUT |
 			LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
 			cmd, (attr >> 16) & 0xffff, attr & 0xffff,
 			NULL, 0, TIMEOUT_MS);
+
+	trace_end_async(start, "xfer", "control", 0);
+
+	return ret;
 }
 
-static int cmd_control_iface(libusb_device_handle *hdl, uint8_t cmd, uint16_t attr)
+static int cmd_control_iface(const struct transport *t, uint8_t cmd,
+			     uint16_t attr)
 {
-	return libusb_control_transfer(hdl, LIBUSB_ENDPOINT_OUT |
-			LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE,
-			cmd, attr, 0, NULL, 0, TIMEOUT_MS);
+	uint64_t start = trace_begin();
+	int ret;
+
+	if (t->local)
+		ret = local_control(t->local, LIBUSB_ENDPOINT_OUT |
+				LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE,
+				cmd, attr, 0, NULL, 0);
+	else
+		ret = libusb_control_transfer(t->hdl, LIBUSB_ENDPOINT_OUT |
+				LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE,
+				cmd, attr, 0, NULL, 0, TIMEOUT_MS);
+
+	trace_end_async(start, "xfer", "control", 0);
+
+	return ret;
 }
 
-static int cmd_load_data(libusb_device_handle *hdl, unsigned char *data,
-			 uint32_t addr, size_t size, bool stage1)
+static int cmd_control_iface_in(const struct transport *t, uint8_t cmd,
+				uint16_t attr, void *data, uint16_t len,
+				unsigned int timeout)
 {
-	int ret, bytes_transferred, to_transfer;
-	size_t to_write;
-	char *ptr;
+	uint64_t start = trace_begin();
+	int ret;
 
-	if (stage1) {
-		/* Send the SET_DATA_LEN command */
-		ret = cmd_control(hdl, CMD_SET_DATA_LEN, size);
-		if (ret)
-			return ret;
+	if (t->local)
+		ret = local_control(t->local, LIBUSB_ENDPOINT_IN |
+				LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE,
+				cmd, attr, 0, data, len);
+	else
+		ret = libusb_control_transfer(t->hdl, LIBUSB_ENDPOINT_IN |
+				LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE,
+				cmd, attr, 0, data, len, timeout);
 
-		/* Send the SET_DATA_ADDR command */
-		ret = cmd_control(hdl, CMD_SET_DATA_ADDR, addr);
-		if (ret)
-			return ret;
+	trace_end_async(start, "xfer", "control", ret > 0 ? ret : 0);
+
+	return ret;
+}
+
+static double elapsed_sec(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec)
+		+ (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int xfer_status_to_error(enum libusb_transfer_status status)
+{
+	switch (status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return 0;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case LIBUSB_TRANSFER_CANCELLED:
+		return LIBUSB_ERROR_INTERRUPTED;
+	default:
+		return LIBUSB_ERROR_IO;
 	}
+}
 
-	ptr = (char *)data;
-	to_write = size;
+static void LIBUSB_CALL xfer_queue_complete(struct libusb_transfer *xfer)
+{
+	struct xfer_slot *slot = xfer->user_data;
+	struct xfer_queue *q = slot->q;
 
-	do {
-		if (to_write > 1024 * 1024)
-			to_transfer = 1024 * 1024;
-		else
-			to_transfer = to_write;
+	trace_end_async(slot->start, "xfer", "bulk", xfer->actual_length);
 
-		ret = libusb_bulk_transfer(hdl, LIBUSB_ENDPOINT_OUT | 0x1,
-					   ptr, to_transfer, &bytes_transferred, 0);
-		if (ret)
-			return ret;
+	/* May be called from another thread handling libusb events */
+	pthread_mutex_lock(&q->lock);
 
-		to_write -= bytes_transferred;
-		ptr += bytes_transferred;
-	} while (to_write > 0);
+	if (!q->status) {
+		q->status = xfer_status_to_error(xfer->status);
 
-	if (addr) {
-		printf("Uploaded %lu bytes at address 0x%08x\n",
-		       (unsigned long)size, addr);
-	} else {
-		printf("Uploaded %lu bytes\n", (unsigned long)size);
+		if (!q->status && xfer->actual_length != xfer->length)
+			q->status = LIBUSB_ERROR_IO;
 	}
 
-	return 0;
+	q->free_slots[q->nb_free++] = slot;
+
+	pthread_mutex_unlock(&q->lock);
 }
 
-static int cmd_load_file(libusb_device_handle *hdl, FILE *f,
-		  uint32_t addr, size_t *data_size, bool stage1)
+static void xfer_queue_put_slot(struct xfer_queue *q, struct xfer_slot *slot,
+				int status)
 {
-	size_t size, to_read;
-	unsigned char *data;
-	char *ptr;
-	int ret;
+	pthread_mutex_lock(&q->lock);
 
-	/* Get the file size */
-	fseek(f, 0, SEEK_END);
-	size = ftell(f);
-	fseek(f, 0, SEEK_SET);
+	q->free_slots[q->nb_free++] = slot;
+	if (!q->status)
+		q->status = status;
 
-	if (data_size)
-		*data_size = size;
+	pthread_mutex_unlock(&q->lock);
+}
 
-	data = malloc(size);
-	if (!data)
-		return -ENOMEM;
+static void xfer_queue_put_status(struct xfer_queue *q, int status)
+{
+	pthread_mutex_lock(&q->lock);
+	if (!q->status)
+		q->status = status;
+	pthread_mutex_unlock(&q->lock);
+}
 
-	ptr = (char *)data;
-	to_read = size;
-	do {
-		size_t bytes_read = fread(ptr, 1, to_read, f);
-		if (!bytes_read) {
-			ret = -EIO;
-			goto out_free;
-		}
+static int xfer_queue_status(struct xfer_queue *q)
+{
+	int status;
 
-		ptr += bytes_read;
-		to_read -= bytes_read;
-	} while (to_read > 0);
+	pthread_mutex_lock(&q->lock);
+	status = q->status;
+	pthread_mutex_unlock(&q->lock);
+
+	return status;
+}
 
-	ret = cmd_load_data(hdl, data, addr, size, stage1);
+static unsigned int xfer_queue_busy(struct xfer_queue *q)
+{
+	unsigned int busy;
 
-out_free:
-	free(data);
+	pthread_mutex_lock(&q->lock);
+	busy = q->nb_slots - q->nb_free;
+	pthread_mutex_unlock(&q->lock);
 
-	return ret;
+	return busy;
 }
 
-static int cmd_load_from_file(libusb_device_handle *hdl, const char *fn,
-			      uint32_t addr, size_t *data_size, bool stage1)
+static void xfer_queue_cancel(struct xfer_queue *q)
 {
-	FILE *f;
-	int ret;
-
-	f = fopen(fn, "rb");
-	if (!f)
-		return ferror(f);
+	unsigned int i;
 
-	ret = cmd_load_file(hdl, f, addr, data_size, stage1);
+	if (q->t->local)
+		return;
 
-	fclose(f);
-	return ret;
+	for (i = 0; i < q->nb_slots; i++)
+		libusb_cancel_transfer(q->slots[i].xfer);
 }
 
-static int load_from_opk(libusb_device_handle *hdl, struct OPK *opk,
-			 const char *fn, enum file_id id)
+static void xfer_queue_free(struct xfer_queue *q)
 {
-	size_t data_size;
-	uint32_t data_size32;
-	void *data;
-	int ret, bytes;
+	unsigned int i;
 
-	ret = opk_extract_file(opk, fn, &data, &data_size);
-	if (ret < 0) {
-		if (ret != -ENOENT)
-			fprintf(stderr, "Unable to extract data\n");
-		return ret;
+	for (i = 0; i < q->nb_slots; i++) {
+		libusb_free_transfer(q->slots[i].xfer);
+		free(q->slots[i].buf);
 	}
 
-	ret = cmd_control_iface(hdl, CMD_OPEN_FILE, id);
-	if (ret) {
-		fprintf(stderr, "Unable to send open: %i\n", ret);
-		goto out_free_data;
-	}
+	pthread_mutex_destroy(&q->lock);
+}
 
-	data_size32 = data_size;
+static int xfer_queue_init(struct xfer_queue *q, const struct transport *t,
+			   unsigned char endpoint)
+{
+	unsigned int i, depth = t->queue_depth ? t->queue_depth : queue_depth;
+	struct xfer_slot *slot;
+
+	pthread_mutex_init(&q->lock, NULL);
+	q->t = t;
+	q->endpoint = endpoint;
+	q->chunk_size = t->chunk_size ? t->chunk_size : chunk_size;
+	q->status = 0;
+	q->nb_free = 0;
+
+	for (i = 0; i < depth; i++) {
+		slot = &q->slots[i];
+		slot->q = q;
+		slot->buf = NULL;
+		slot->xfer = libusb_alloc_transfer(0);
+		if (!slot->xfer)
+			break;
 
-	ret = libusb_bulk_transfer(hdl, LIBUSB_ENDPOINT_OUT | 0x1,
-			(unsigned char *)&data_size32, 4, &bytes, TIMEOUT_MS);
-	if (ret) {
-		fprintf(stderr, "Unable to write data size: %i\n", ret);
-		goto out_free_data;
+		q->free_slots[q->nb_free++] = slot;
 	}
 
-	ret = cmd_load_data(hdl, data, 0x0, data_size, false);
-	if (ret) {
-		fprintf(stderr, "Unable to upload file: %i\n", ret);
-		goto out_free_data;
-	}
+	q->nb_slots = i;
 
-	ret = cmd_control_iface(hdl, CMD_CLOSE_FILE, 0);
-	if (ret) {
-		fprintf(stderr, "Unable to close!\n");
-		goto out_free_data;
+	if (i < depth) {
+		xfer_queue_free(q);
+		return LIBUSB_ERROR_NO_MEM;
 	}
 
-
-out_free_data:
-	free(data);
-	return ret;
+	return 0;
 }
 
-int main(int argc, char **argv)
+/* Handle USB events until at most 'max_busy' transfers are still in flight */
+static void xfer_queue_reap(struct xfer_queue *q, unsigned int max_busy)
 {
-	libusb_context *usb_ctx;
-	libusb_device_handle *hdl;
-	struct OPK *opk;
-	unsigned int i, choice = 0;
-	const char *fn, *firstdot, *lastdot;
-	char *boardname, buf[256];
-	unsigned int group, board;
-	size_t data_size, kernel_size;
-	void *data;
 	int ret;
 
-	// windows bundled libc with mingw does caching of buffers
-	// this call disable caching
-#ifdef _WIN32
-	setbuf(stdout, NULL);
-#endif
-
-	if (HAS_BUILTIN_INSTALLER && argc != 2) {
-		printf("Usage:\n\todboot-client od-update.opk\n");
-		return EXIT_FAILURE;
-	} else if (!HAS_BUILTIN_INSTALLER && argc != 3) {
-		printf("Usage:\n\todboot-client od-update.opk vmlinuz.bin\n");
-		return EXIT_FAILURE;
+	while (xfer_queue_busy(q) > max_busy) {
+		ret = libusb_handle_events_completed(usb_ctx, NULL);
+		if (ret && ret != LIBUSB_ERROR_INTERRUPTED) {
+			xfer_queue_put_status(q, ret);
+			xfer_queue_cancel(q);
+		}
 	}
+}
 
-	opk = opk_open(argv[1]);
-	if (!opk) {
-		fprintf(stderr, "Unable to open OPK file\n");
-		return EXIT_FAILURE;
-	}
+/* Wait for a free slot, and take it out of the free list */
+static struct xfer_slot * xfer_queue_get_slot(struct xfer_queue *q)
+{
+	struct xfer_slot *slot = NULL;
 
-	ret = opk_open_metadata(opk, &fn);
-	if (ret <= 0)
-		goto err_close_opk;
+	xfer_queue_reap(q, q->nb_slots - 1);
 
-	firstdot = strchr(fn, '.');
-	if (!firstdot)
-		goto err_close_opk;
+	pthread_mutex_lock(&q->lock);
+	if (!q->status)
+		slot = q->free_slots[--q->nb_free];
+	pthread_mutex_unlock(&q->lock);
 
-	lastdot = strchr(firstdot + 1, '.');
-	if (!lastdot)
-		goto err_close_opk;
+	return slot;
+}
 
-	boardname = strndup(firstdot + 1, lastdot - firstdot - 1);
+static int xfer_queue_submit_slot(struct xfer_queue *q, struct xfer_slot *slot,
+				  unsigned char *buf, unsigned int len)
+{
+	int ret;
 
-	ret = get_device(boardname, &group, &board);
-	if (ret < 0)
-		goto err_close_opk;
+	slot->start = trace_begin();
 
-	ret = libusb_init(&usb_ctx);
-	if (ret) {
-		fprintf(stderr, "Unable to init libusb\n");
+	/* Local writes complete synchronously, nothing is left in flight */
+	if (q->t->local) {
+		ret = local_bulk_write(q->t->local, q->endpoint & 0x7f, buf, len);
+		trace_end_async(slot->start, "xfer", "bulk", len);
+		xfer_queue_put_slot(q, slot, ret ? LIBUSB_ERROR_IO : 0);
 		return ret;
 	}
 
-	printf("trying to init device 0x%llx 0x%llx\n", groups[group].vid, groups[group].pid);
+	libusb_fill_bulk_transfer(slot->xfer, q->t->hdl, q->endpoint,
+				  buf, len, xfer_queue_complete, slot, 0);
 
-	hdl = libusb_open_device_with_vid_pid(usb_ctx,
-					      groups[group].vid,
-					      groups[group].pid);
-	if (!hdl) {
-		fprintf(stderr, "Unable to find Ingenic device.\n");
-		ret = -ENOENT;
-		goto out_exit_libusb;
-	}
+	ret = libusb_submit_transfer(slot->xfer);
+	if (ret)
+		xfer_queue_put_slot(q, slot, ret);
 
-	ret = libusb_claim_interface(hdl, 0);
-	if (ret) {
-		fprintf(stderr, "Unable to claim interface 0\n");
-		goto out_close_dev_handle;
-	}
+	return ret;
+}
 
-	if (cmd_get_info(hdl)) {
-		fprintf(stderr, "Unable to read CPU info\n");
-		goto out_close_dev_handle;
-	}
+/*
+ * Queue 'len' bytes from 'buf' for upload on the bulk OUT endpoint.
+ * The buffer is not copied, and must stay valid until xfer_queue_finish().
+ */
+static int xfer_queue_submit(struct xfer_queue *q, unsigned char *buf, size_t len)
+{
+	struct xfer_slot *slot;
+	unsigned int to_transfer;
 
-	snprintf(buf, sizeof(buf), "%s/ubiboot-stage1-%s.bin", boardname,
-		 groups[group].boards[board].btl_code);
+	while (len > 0) {
+		slot = xfer_queue_get_slot(q);
+		if (!slot)
+			break;
 
-	ret = opk_extract_file(opk, buf, &data, &data_size);
-	if (ret < 0) {
-		fprintf(stderr, "Unable to extract stage1 bootloader\n");
-		goto err_close_opk;
-	}
+		if (len > q->chunk_size)
+			to_transfer = q->chunk_size;
+		else
+			to_transfer = len;
 
-	ret = cmd_load_data(hdl, data, 0x80000000, data_size, true);
-	free(data);
+		if (xfer_queue_submit_slot(q, slot, buf, to_transfer))
+			break;
 
-	if (ret) {
-		fprintf(stderr, "Unable to upload stage1 bootloader\n");
-		goto out_close_dev_handle;
+		buf += to_transfer;
+		len -= to_transfer;
 	}
 
-	printf("Uploaded bootloader\n");
+	return xfer_queue_status(q);
+}
 
-	ret = cmd_control(hdl, CMD_START1, 0x80000000);
-	if (ret) {
-		fprintf(stderr, "Unable to execute stage1 bootloader\n");
-		goto out_close_dev_handle;
-	}
+/*
+ * Get a free slot with its own buffer of one chunk. The caller
+ * fills the buffer then queues it with xfer_queue_submit_slot().
+ */
+static struct xfer_slot * xfer_queue_get_buffer(struct xfer_queue *q)
+{
+	struct xfer_slot *slot;
 
-	/* Wait for stage1 to complete operation */
-	for (i = 0; i < 100; i++) {
-		if (!cmd_get_info(hdl))
-			break;
+	slot = xfer_queue_get_slot(q);
+	if (!slot || slot->buf)
+		return slot;
 
-		usleep(10000); /* 10ms * 100 = 1s */
+	slot->buf = malloc(q->chunk_size);
+	if (!slot->buf) {
+		xfer_queue_put_slot(q, slot, LIBUSB_ERROR_NO_MEM);
+		return NULL;
 	}
 
-	if (i == 100) {
-		fprintf(stderr, "Stage1 bootloader did not return.\n");
-		goto out_close_dev_handle;
-	}
+	return slot;
+}
 
-	if (HAS_BUILTIN_INSTALLER) {
-		kernel_size = (uintptr_t)&__end_image - (uintptr_t)&__start_image;
-		ret = cmd_load_data(hdl, (unsigned char *)&__start_image,
-				    0x81000000, kernel_size, true);
-	} else {
-		ret = cmd_load_from_file(hdl, argv[2], 0x81000000, &kernel_size, true);
-	}
-	if (ret) {
-		fprintf(stderr, "Unable to upload kernel\n");
-		goto out_close_dev_handle;
-	}
+/*
+ * Copy 'len' bytes from 'buf' into the slots' own buffers and queue them.
+ * The buffer can be reused as soon as this function returns.
+ */
+static int xfer_queue_write(struct xfer_queue *q, const void *buf, size_t len)
+{
+	const unsigned char *ptr = buf;
+	struct xfer_slot *slot;
+	unsigned int to_transfer;
 
-	printf("Uploaded kernel\n");
+	/* Socket writes are synchronous, there is no need for a copy */
+	if (q->t->local)
+		return xfer_queue_submit(q, (unsigned char *)buf, len);
 
-	snprintf(buf, sizeof(buf), "%s/%s.dtb", boardname,
-		 groups[group].boards[board].dts_code);
+	while (len > 0) {
+		slot = xfer_queue_get_buffer(q);
+		if (!slot)
+			break;
+
+		if (len > q->chunk_size)
+			to_transfer = q->chunk_size;
+		else
+			to_transfer = len;
+
+		memcpy(slot->buf, ptr, to_transfer);
+
+		if (xfer_queue_submit_slot(q, slot, slot->buf, to_transfer))
+			break;
+
+		ptr += to_transfer;
+		len -= to_transfer;
+	}
+
+	return xfer_queue_status(q);
+}
+
+/* Wait for all the queued transfers, then release the queue */
+static int xfer_queue_finish(struct xfer_queue *q)
+{
+	if (xfer_queue_status(q))
+		xfer_queue_cancel(q);
+
+	xfer_queue_reap(q, 0);
+	xfer_queue_free(q);
+
+	return xfer_queue_status(q);
+}
+
+static void report_upload(size_t size, uint32_t addr,
+			  const struct timespec *start)
+{
+	double secs, rate;
+
+	secs = elapsed_sec(start);
+	rate = secs > 0.0 ? size / secs / 1e6 : 0.0;
+
+	if (addr) {
+		printf("Uploaded %lu bytes at address 0x%08x (%.2f MB/s)\n",
+		       (unsigned long)size, addr, rate);
+	} else {
+		printf("Uploaded %lu bytes (%.2f MB/s)\n",
+		       (unsigned long)size, rate);
+	}
+}
+
+static int cmd_load_data(libusb_device_handle *hdl, unsigned char *data,
+			 uint32_t addr, size_t size, bool stage1)
+{
+	struct transport t = { .hdl = hdl };
+	struct xfer_queue q;
+	struct timespec start;
+	int ret;
+
+	if (stage1) {
+		/* Send the SET_DATA_LEN command */
+		ret = cmd_control(hdl, CMD_SET_DATA_LEN, size);
+		if (ret)
+			return ret;
+
+		/* Send the SET_DATA_ADDR command */
+		ret = cmd_control(hdl, CMD_SET_DATA_ADDR, addr);
+		if (ret)
+			return ret;
+	}
+
+	ret = xfer_queue_init(&q, &t, LIBUSB_ENDPOINT_OUT | 0x1);
+	if (ret)
+		return ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	xfer_queue_submit(&q, data, size);
+
+	ret = xfer_queue_finish(&q);
+	if (ret)
+		return ret;
+
+	report_upload(size, addr, &start);
+
+	return 0;
+}
+
+/*
+ * Map a whole local file, such as vmlinuz.bin, so that it is uploaded
+ * straight from the page cache. Falls back to reading it into memory.
+ */
+static int load_file(const char *fn, struct artifact *artifact)
+{
+	size_t size, to_read;
+	unsigned char *data;
+	char *ptr;
+	FILE *f;
+
+#ifndef _WIN32
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(fn, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			/* The file is sent in order: start reading it now */
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			posix_fadvise(fd, 0, st.st_size, POSIX_FADV_WILLNEED);
+
+			artifact->data = map;
+			artifact->size = st.st_size;
+			artifact->mapped = true;
+			artifact->fd = fd;
+			return 0;
+		}
+	}
+
+	close(fd);
+#endif
+
+	f = fopen(fn, "rb");
+	if (!f)
+		return -errno;
+
+	/* Get the file size */
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	data = malloc(size);
+	if (!data) {
+		fclose(f);
+		return -ENOMEM;
+	}
+
+	ptr = (char *)data;
+	to_read = size;
+	while (to_read > 0) {
+		size_t bytes_read = fread(ptr, 1, to_read, f);
+		if (!bytes_read) {
+			free(data);
+			fclose(f);
+			return -EIO;
+		}
+
+		ptr += bytes_read;
+		to_read -= bytes_read;
+	}
+
+	fclose(f);
+
+	artifact->data = data;
+	artifact->size = size;
+	artifact->mapped = false;
+	artifact->fd = -1;
+
+	return 0;
+}
+
+#ifndef _WIN32
+/*
+ * libopk can only extract a file as a whole. OPKs are squashfs images,
+ * so when squashfs-tools are installed, let unsquashfs decompress the
+ * file into a pipe, while we upload what it already produced.
+ * Without 'fn', only the option is passed.
+ */
+static pid_t spawn_unsquashfs(const char *option, const char *fn, int *fd)
+{
+	int fds[2], null_fd;
+	pid_t pid;
+
+	/* Other threads spawn too, and must not keep the write end open */
+	if (pipe2(fds, O_CLOEXEC))
+		return -errno;
+
+	pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return -errno;
+	}
+
+	if (!pid) {
+		null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+		if (null_fd >= 0)
+			dup2(null_fd, STDERR_FILENO);
+
+		dup2(fds[1], STDOUT_FILENO);
+
+		if (fn)
+			execlp("unsquashfs", "unsquashfs", option,
+			       opk_filename, fn, (char *)NULL);
+		else
+			execlp("unsquashfs", "unsquashfs", option, (char *)NULL);
+		_exit(127);
+	}
+
+	close(fds[1]);
+	*fd = fds[0];
+
+	return pid;
+}
+
+static int wait_unsquashfs(pid_t pid)
+{
+	int status;
+
+	while (waitpid(pid, &status, 0) == -1) {
+		if (errno != EINTR)
+			return -errno;
+	}
+
+	if (!WIFEXITED(status))
+		return -EIO;
+
+	return WEXITSTATUS(status);
+}
+
+static pthread_once_t unsquashfs_once = PTHREAD_ONCE_INIT;
+static bool unsquashfs_has_cat;
+
+/* -cat appeared in squashfs-tools 4.5; older versions only list files */
+static void unsquashfs_probe(void)
+{
+	unsigned int major, minor;
+	char line[256];
+	FILE *f;
+	pid_t pid;
+	int fd;
+
+	pid = spawn_unsquashfs("-version", NULL, &fd);
+	if (pid < 0)
+		return;
+
+	f = fdopen(fd, "r");
+	if (!f) {
+		close(fd);
+		wait_unsquashfs(pid);
+		return;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "unsquashfs version %u.%u", &major, &minor) == 2)
+			unsquashfs_has_cat = major > 4 || (major == 4 && minor >= 5);
+	}
+
+	fclose(f);
+
+	if (wait_unsquashfs(pid))
+		unsquashfs_has_cat = false;
+}
+
+/* Get the size of a file within the OPK from the unsquashfs listing */
+static int unsquashfs_file_size(const char *fn, size_t *size)
+{
+	char line[512], name[256], path[256];
+	unsigned long long file_size;
+	bool found = false;
+	FILE *f;
+	int fd, ret;
+	pid_t pid;
+
+	pthread_once(&unsquashfs_once, unsquashfs_probe);
+	if (!unsquashfs_has_cat)
+		return -ENOSYS;
+
+	pid = spawn_unsquashfs("-lls", fn, &fd);
+	if (pid < 0)
+		return pid;
+
+	f = fdopen(fd, "r");
+	if (!f) {
+		ret = -errno;
+		close(fd);
+		wait_unsquashfs(pid);
+		return ret;
+	}
+
+	snprintf(path, sizeof(path), "squashfs-root/%s", fn);
+
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] != '-')
+			continue;
+
+		if (sscanf(line, "%*s %*s %llu %*s %*s %255s",
+			   &file_size, name) == 2 && !strcmp(name, path)) {
+			*size = file_size;
+			found = true;
+		}
+	}
+
+	fclose(f);
+
+	/* Let libopk handle the file if unsquashfs cannot list it */
+	ret = wait_unsquashfs(pid);
+	if (ret || !found)
+		return -ENOSYS;
+
+	return 0;
+}
+#endif
+
+/* Get a file from the cache, or extract it from the OPK and cache it */
+static int extract_file(struct OPK *opk, pthread_mutex_t *lock,
+			const char *fn, struct artifact *artifact)
+{
+	uint64_t start = trace_begin();
+
+	artifact->fd = -1;
+	artifact->mapped = use_cache &&
+		!cache_lookup(&cache, fn, &artifact->data, &artifact->size,
+			      &artifact->fd);
+	if (artifact->mapped) {
+		trace_end(start, "extract", fn, artifact->size);
+		artifact->ret = 0;
+		return 0;
+	}
+
+	artifact->data = NULL;
+
+	/* libopk is not thread-safe, unless each thread has its own handle */
+	if (lock)
+		pthread_mutex_lock(lock);
+	artifact->ret = opk_extract_file(opk, fn, &artifact->data,
+					 &artifact->size);
+	if (lock)
+		pthread_mutex_unlock(lock);
+
+	if (use_cache && artifact->ret >= 0)
+		cache_store(&cache, fn, artifact->data, artifact->size);
+
+	trace_end(start, "extract", fn, artifact->ret >= 0 ? artifact->size : 0);
+
+	return artifact->ret;
+}
+
+static void release_file(struct artifact *artifact)
+{
+	if (artifact->mapped) {
+		cache_release(artifact->data, artifact->size);
+		close(artifact->fd);
+	} else {
+		free(artifact->data);
+	}
+}
+
+static void prefetch_wait(struct prefetch *prefetch, unsigned int id)
+{
+	pthread_mutex_lock(&prefetch->lock);
+	while (!prefetch->ready[id])
+		pthread_cond_wait(&prefetch->cond, &prefetch->lock);
+	pthread_mutex_unlock(&prefetch->lock);
+}
+
+/* 'lock' serializes libopk calls on a shared handle, or is NULL */
+static int opk_stream_open(struct opk_stream *stream, struct OPK *opk,
+			   pthread_mutex_t *lock, const char *fn)
+{
+	uint64_t start;
+	int ret;
+
+	stream->offset = 0;
+	stream->data = NULL;
+	stream->shared = false;
+	stream->mapped = false;
+	stream->caching = false;
+	stream->file_fd = -1;
+#ifndef _WIN32
+	stream->pid = -1;
+#endif
+
+	if (use_cache && !cache_lookup(&cache, fn, &stream->data,
+				       &stream->size, &stream->file_fd)) {
+		stream->mapped = true;
+		return 0;
+	}
+
+#ifndef _WIN32
+	ret = unsquashfs_file_size(fn, &stream->size);
+	if (!ret) {
+		stream->pid = spawn_unsquashfs("-cat", fn, &stream->fd);
+		if (stream->pid >= 0) {
+			stream->caching = use_cache &&
+				!cache_writer_open(&cache, fn, &stream->cw);
+			return 0;
+		}
+	}
+#endif
+
+	start = trace_begin();
+
+	/* libopk is not thread-safe */
+	if (lock)
+		pthread_mutex_lock(lock);
+	ret = opk_extract_file(opk, fn, &stream->data, &stream->size);
+	if (lock)
+		pthread_mutex_unlock(lock);
+
+	if (use_cache && ret >= 0)
+		cache_store(&cache, fn, stream->data, stream->size);
+
+	trace_end(start, "extract", fn, ret >= 0 ? stream->size : 0);
+
+	return ret;
+}
+
+static ssize_t opk_stream_read(struct opk_stream *stream,
+			       unsigned char *buf, size_t len)
+{
+	size_t left = stream->size - stream->offset;
+#ifndef _WIN32
+	size_t bytes_read = 0;
+	ssize_t ret;
+#endif
+
+	if (len > left)
+		len = left;
+
+	if (stream->data) {
+		memcpy(buf, (char *)stream->data + stream->offset, len);
+		stream->offset += len;
+		return len;
+	}
+
+#ifndef _WIN32
+	while (bytes_read < len) {
+		ret = read(stream->fd, buf + bytes_read, len - bytes_read);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		if (!ret)
+			return -EIO;
+
+		bytes_read += ret;
+	}
+
+	stream->offset += bytes_read;
+
+	if (stream->caching &&
+	    cache_writer_write(&stream->cw, buf, bytes_read)) {
+		cache_writer_abort(&stream->cw);
+		stream->caching = false;
+	}
+
+	return bytes_read;
+#else
+	return -EIO;
+#endif
+}
+
+/*
+ * Get the next 'len' bytes of the file. Files that are in memory are not
+ * copied: 'data' points into them, and otherwise to 'buf'.
+ */
+static ssize_t opk_stream_get(struct opk_stream *stream, unsigned char *buf,
+			      size_t len, const unsigned char **data)
+{
+	size_t left = stream->size - stream->offset;
+
+	if (!stream->data) {
+		*data = buf;
+		return opk_stream_read(stream, buf, len);
+	}
+
+	if (len > left)
+		len = left;
+
+	*data = (const unsigned char *)stream->data + stream->offset;
+	stream->offset += len;
+
+	return len;
+}
+
+static void opk_stream_close(struct opk_stream *stream)
+{
+#ifndef _WIN32
+	int ret;
+#endif
+
+	if (stream->mapped) {
+		cache_release(stream->data, stream->size);
+		close(stream->file_fd);
+	} else if (!stream->shared) {
+		free(stream->data);
+	}
+
+#ifndef _WIN32
+	if (stream->pid >= 0) {
+		close(stream->fd);
+
+		if (stream->offset < stream->size)
+			kill(stream->pid, SIGTERM);
+
+		ret = wait_unsquashfs(stream->pid);
+
+		/* Only cache files that were read completely */
+		if (stream->caching && !ret && stream->offset == stream->size)
+			cache_writer_commit(&cache, &stream->cw);
+		else if (stream->caching)
+			cache_writer_abort(&stream->cw);
+	}
+#endif
+}
+
+/* Get the hashes of the blocks of the file currently on the device */
+static int cmd_get_manifest(const struct transport *t, enum file_id id,
+			    struct manifest *manifest)
+{
+	unsigned char page_buf[MANIFEST_PAGE_SIZE];
+	struct manifest_header *hdr = (struct manifest_header *)page_buf;
+	unsigned int i, page, count, received = 0;
+	int ret;
+
+	manifest->hashes = NULL;
+
+	for (page = 0; page < 256; page++) {
+		ret = cmd_control_iface_in(t, CMD_GET_MANIFEST, id | page << 8,
+					   page_buf, sizeof(page_buf),
+					   MANIFEST_TIMEOUT_MS);
+		if (ret < (int)sizeof(*hdr))
+			goto err_free_hashes;
+
+		if (!page) {
+			manifest->file_size = LE32(hdr->file_size);
+			manifest->block_size = LE32(hdr->block_size);
+			manifest->nb_blocks = LE32(hdr->nb_blocks);
+
+			if (!manifest->nb_blocks)
+				return 0;
+
+			manifest->hashes = calloc(manifest->nb_blocks,
+						  sizeof(*manifest->hashes));
+			if (!manifest->hashes)
+				return -ENOMEM;
+		}
+
+		count = (ret - sizeof(*hdr)) / sizeof(uint64_t);
+		if (!count || LE32(hdr->first_block) != received ||
+		    count > manifest->nb_blocks - received)
+			goto err_free_hashes;
+
+		memcpy(&manifest->hashes[received], hdr + 1,
+		       count * sizeof(uint64_t));
+
+		for (i = received; i < received + count; i++)
+			manifest->hashes[i] = LE64(manifest->hashes[i]);
+
+		received += count;
+
+		if (received == manifest->nb_blocks)
+			return 0;
+	}
+
+err_free_hashes:
+	free(manifest->hashes);
+	manifest->hashes = NULL;
+	return ret < 0 ? ret : -EIO;
+}
+
+static void extent_writer_init(struct extent_writer *ew, struct xfer_queue *q,
+			       unsigned char *run, unsigned char *packed,
+			       const struct opk_stream *stream)
+{
+	memset(ew, 0, sizeof(*ew));
+	ew->q = q;
+	ew->run = run;
+	ew->src = stream->data;
+	ew->src_fd = stream->file_fd;
+	ew->packed = packed;
+	ew->compress = !!packed;
+}
+
+static void send_extent(struct xfer_queue *q, uint32_t offset, uint32_t length,
+			uint32_t flags, const unsigned char *data)
+{
+	struct extent extent = {
+		.offset = LE32(offset),
+		.length = LE32(length),
+		.flags = LE32(flags),
+	};
+
+	xfer_queue_write(q, &extent, sizeof(extent));
+
+	if (data)
+		xfer_queue_write(q, data, length);
+}
+
+/*
+ * Send a run of a file that is in memory. The data is not copied: sockets
+ * get it straight from the cache file, and USB transfers from the mapping.
+ */
+static void send_mapped_extent(struct extent_writer *ew)
+{
+	struct xfer_queue *q = ew->q;
+	int ret = -ENOSYS;
+
+	send_extent(q, ew->run_offset, ew->run_len, 0, NULL);
+
+	if (q->t->local && ew->src_fd >= 0) {
+		uint64_t start = trace_begin();
+
+		ret = local_bulk_sendfile(q->t->local, q->endpoint & 0x7f,
+					  ew->src_fd, ew->run_offset,
+					  ew->run_len);
+		if (ret && ret != -ENOSYS)
+			xfer_queue_put_status(q, LIBUSB_ERROR_IO);
+		if (!ret)
+			trace_end_async(start, "xfer", "sendfile", ew->run_len);
+	}
+
+	if (ret == -ENOSYS)
+		xfer_queue_submit(q, (unsigned char *)ew->src + ew->run_offset,
+				  ew->run_len);
+}
+
+/*
+ * Send a run as an LZ4 block, if that saves at least an eighth of it.
+ * Files that do not compress, like squashfs images, are detected on their
+ * first megabyte and sent as they are from then on.
+ */
+static bool send_packed_extent(struct extent_writer *ew)
+{
+	const unsigned char *data = ew->src ? ew->src + ew->run_offset : ew->run;
+	uint32_t packed_len, le_len;
+
+	packed_len = lz4_compress(data, ew->run_len, ew->packed + 4,
+				  ew->run_len - ew->run_len / 8);
+
+	ew->probed += ew->run_len;
+
+	if (!packed_len) {
+		if (ew->probed >= COMPRESS_PROBE_SIZE && !ew->packed_in)
+			ew->compress = false;
+		return false;
+	}
+
+	le_len = LE32(packed_len);
+	memcpy(ew->packed, &le_len, 4);
+
+	send_extent(ew->q, ew->run_offset, ew->run_len, EXTENT_LZ4, NULL);
+	xfer_queue_write(ew->q, ew->packed, packed_len + 4);
+
+	ew->packed_in += ew->run_len;
+	ew->packed_out += packed_len;
+
+	return true;
+}
+
+/* Send the pending data and zero extents */
+static void extent_writer_flush(struct extent_writer *ew)
+{
+	if (ew->run_len) {
+		if (!ew->compress || !send_packed_extent(ew)) {
+			if (ew->src)
+				send_mapped_extent(ew);
+			else
+				send_extent(ew->q, ew->run_offset, ew->run_len,
+					    0, ew->run);
+		}
+		ew->sent += ew->run_len;
+		ew->run_len = 0;
+	}
+
+	if (ew->zero_len) {
+		send_extent(ew->q, ew->zero_offset, ew->zero_len,
+			    EXTENT_ZERO, NULL);
+		ew->zeroed += ew->zero_len;
+		ew->zero_len = 0;
+	}
+}
+
+static void extent_writer_data(struct extent_writer *ew, size_t offset,
+			       const unsigned char *data, size_t len)
+{
+	if (ew->zero_len || (ew->run_len &&
+	    (ew->run_offset + ew->run_len != offset ||
+	     ew->run_len + len > MAX_EXTENT_SIZE)))
+		extent_writer_flush(ew);
+
+	if (!ew->run_len)
+		ew->run_offset = offset;
+
+	if (!ew->src)
+		memcpy(ew->run + ew->run_len, data, len);
+	ew->run_len += len;
+}
+
+static void extent_writer_zero(struct extent_writer *ew, size_t offset,
+			       size_t len)
+{
+	if (ew->run_len || (ew->zero_len &&
+	    ew->zero_offset + ew->zero_len != offset))
+		extent_writer_flush(ew);
+
+	if (!ew->zero_len)
+		ew->zero_offset = offset;
+
+	ew->zero_len += len;
+}
+
+static bool is_zero(const unsigned char *buf, size_t len)
+{
+	return !buf[0] && !memcmp(buf, buf + 1, len - 1);
+}
+
+/*
+ * Queue the file as a list of extents. Blocks whose hash matches the
+ * device's manifest (if any) are skipped, and pages that only contain
+ * zeros are sent as zero extents, without data. What was sent is counted
+ * in 'ew'.
+ */
+static int queue_extents(struct xfer_queue *q, struct opk_stream *stream,
+			 const struct manifest *manifest, uint32_t *crc,
+			 struct extent_writer *ew)
+{
+	uint32_t block_size = DEFAULT_BLOCK_SIZE;
+	unsigned char *block, *run, *packed = NULL;
+	const unsigned char *data;
+	ssize_t bytes_read;
+	size_t offset, len, page_len;
+	unsigned int i, idx;
+	int ret;
+
+	if (manifest && manifest->block_size &&
+	    manifest->block_size <= MAX_EXTENT_SIZE)
+		block_size = manifest->block_size;
+
+	block = malloc(block_size);
+	run = malloc(MAX_EXTENT_SIZE);
+	if (q->t->compress)
+		packed = malloc(4 + MAX_EXTENT_SIZE);
+	if (!block || !run || (q->t->compress && !packed)) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	extent_writer_init(ew, q, run, packed, stream);
+
+	while (stream->offset < stream->size && !xfer_queue_status(q)) {
+		offset = stream->offset;
+		idx = offset / block_size;
+
+		/* A resumed transfer gets back to whole blocks first */
+		len = block_size - offset % block_size;
+
+		bytes_read = opk_stream_get(stream, block, len, &data);
+		if (bytes_read < 0) {
+			fprintf(stderr, "Unable to read from OPK: %s\n",
+				strerror(-bytes_read));
+			xfer_queue_put_status(q, LIBUSB_ERROR_IO);
+			break;
+		}
+
+		*crc = crc32c(*crc, data, bytes_read);
+
+		if (manifest && len == block_size && idx < manifest->nb_blocks &&
+		    manifest->hashes[idx] == xxh64(data, bytes_read, 0)) {
+			extent_writer_flush(ew);
+			continue;
+		}
+
+		for (i = 0; i < bytes_read; i += page_len) {
+			page_len = bytes_read - i;
+			if (page_len > SPARSE_PAGE_SIZE)
+				page_len = SPARSE_PAGE_SIZE;
+
+			if (is_zero(data + i, page_len))
+				extent_writer_zero(ew, offset + i, page_len);
+			else
+				extent_writer_data(ew, offset + i,
+						   data + i, page_len);
+		}
+	}
+
+	extent_writer_flush(ew);
+
+	/* Terminate the list of extents */
+	send_extent(q, 0, 0, 0, NULL);
+
+	ret = xfer_queue_status(q);
+
+out_free:
+	free(packed);
+	free(run);
+	free(block);
+	return ret;
+}
+
+static void report_extents(const struct extent_writer *ew, size_t size,
+			   const struct timespec *start)
+{
+	printf("Sent %lu of %lu bytes (%lu bytes of zeros), ",
+	       (unsigned long)ew->sent, (unsigned long)size,
+	       (unsigned long)ew->zeroed);
+	if (ew->packed_in)
+		printf("%lu bytes compressed to %lu, ",
+		       (unsigned long)ew->packed_in,
+		       (unsigned long)ew->packed_out);
+	report_upload(ew->sent, 0x0, start);
+}
+
+static int cmd_load_extents(const struct transport *t, unsigned char ep,
+			    struct opk_stream *stream,
+			    const struct manifest *manifest, uint32_t *crc)
+{
+	struct extent_writer ew;
+	struct timespec start;
+	struct xfer_queue q;
+	int ret, ret2;
+
+	ret = xfer_queue_init(&q, t, ep);
+	if (ret)
+		return ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	ret = queue_extents(&q, stream, manifest, crc, &ew);
+
+	ret2 = xfer_queue_finish(&q);
+	if (!ret)
+		ret = ret2;
+
+	if (!ret)
+		report_extents(&ew, stream->size, &start);
+
+	return ret;
+}
+
+/* Check that the device received the same data that was sent */
+static int cmd_verify_digest(const struct transport *t, enum file_id id,
+			     uint32_t size, uint32_t crc)
+{
+	struct digest digest;
+	int ret;
+
+	ret = cmd_control_iface_in(t, CMD_GET_DIGEST, id,
+				   &digest, sizeof(digest), TIMEOUT_MS);
+	if (ret == LIBUSB_ERROR_PIPE) {
+		printf("Device does not report digests, skipping verification\n");
+		return 0;
+	}
+
+	if (ret < 0)
+		return ret;
+	if (ret != sizeof(digest))
+		return -EIO;
+
+	digest.size = LE32(digest.size);
+	digest.crc32c = LE32(digest.crc32c);
+	digest.flags = LE32(digest.flags);
+
+	if (!(digest.flags & DIGEST_VALID)) {
+		fprintf(stderr, "Device could not compute the digest\n");
+		return -EIO;
+	}
+
+	if (digest.size != size || digest.crc32c != crc) {
+		fprintf(stderr, "Digest mismatch: sent %u bytes, CRC32C 0x%08x; "
+			"device has %u bytes, CRC32C 0x%08x\n", size, crc,
+			digest.size, digest.crc32c);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static unsigned int get_open_flags(const struct transport *t,
+				   const struct opk_stream *stream,
+				   const struct manifest *manifest)
+{
+	unsigned int open_flags = OPEN_FLAG_EXTENTS;
+
+	if (manifest)
+		open_flags |= OPEN_FLAG_KEEP;
+	if (t->compress)
+		open_flags |= OPEN_FLAG_LZ4;
+	if (stream->offset)
+		open_flags |= OPEN_FLAG_RESUME;
+
+	return open_flags;
+}
+
+/*
+ * Send a file to odbootd as a list of extents over the given stream, and
+ * wait until it is written. With a manifest, the file is updated in place.
+ * If the stream is past its start, the interrupted transfer of the file
+ * is resumed from there, and '*crc' holds the CRC32C of what was skipped.
+ */
+static int upload_file(const struct transport *t, struct opk_stream *stream,
+		       enum file_id id, unsigned int stream_idx,
+		       const struct manifest *manifest, uint32_t *crc)
+{
+	unsigned int open_flags = get_open_flags(t, stream, manifest);
+	uint32_t data_size32;
+	int ret, bytes;
+
+	ret = cmd_control_iface(t, CMD_OPEN_FILE,
+				OPEN_ATTR(id, open_flags, stream_idx));
+	if (ret) {
+		fprintf(stderr, "Unable to send open: %i\n", ret);
+		return ret;
+	}
+
+	data_size32 = LE32(stream->size);
+
+	if (t->local)
+		ret = local_bulk_write(t->local, t->endpoints[stream_idx] & 0x7f,
+				       &data_size32, 4);
+	else
+		ret = libusb_bulk_transfer(t->hdl, t->endpoints[stream_idx],
+				(unsigned char *)&data_size32, 4, &bytes, TIMEOUT_MS);
+	if (ret) {
+		fprintf(stderr, "Unable to write data size: %i\n", ret);
+		return ret;
+	}
+
+	ret = cmd_load_extents(t, t->endpoints[stream_idx], stream, manifest, crc);
+	if (ret) {
+		fprintf(stderr, "Unable to upload file: %i\n", ret);
+		return ret;
+	}
+
+	ret = cmd_control_iface(t, CMD_CLOSE_FILE,
+				OPEN_ATTR(0, 0, stream_idx));
+	if (ret)
+		fprintf(stderr, "Unable to close!\n");
+
+	return ret;
+}
+
+static void get_stage2_path(char *buf, size_t len, unsigned int id,
+			    const struct flash_params *params)
+{
+	const char *boardname = params->boardname;
+	const struct board *board = params->board;
+
+	if (files_to_upload[id]) {
+		snprintf(buf, len, "%s/%s", boardname, files_to_upload[id]);
+	} else if (id == ID_DTB) {
+		snprintf(buf, len, "%s/%s.dtb", boardname, board->dts_code);
+	} else if (id == ID_UBIBOOT) {
+		snprintf(buf, len, "%s/ubiboot-%s.bin",
+			 boardname, board->btl_code);
+	}
+}
+
+/*
+ * Queue a file in the batch of a stream, which is opened with the first
+ * one. The device opens the file when it gets there in the stream, so the
+ * link never waits for it. The batch takes over 'stream', even on error.
+ */
+static int batch_add(struct batch *batch, const struct transport *t,
+		     struct opk_stream *stream, enum file_id id,
+		     const struct manifest *manifest, uint32_t *crc)
+{
+	struct batch_entry entry = {
+		.file_id = LE32(id),
+		.flags = LE32(get_open_flags(t, stream, manifest)),
+		.size = LE32(stream->size),
+	};
+	struct extent_writer ew;
+	struct timespec start;
+	int ret;
+
+	batch->streams[batch->nb_streams++] = *stream;
+	stream = &batch->streams[batch->nb_streams - 1];
+
+	if (!batch->open) {
+		ret = xfer_queue_init(&batch->q, t, t->endpoints[batch->stream]);
+		if (ret)
+			return ret;
+
+		ret = cmd_control_iface(t, CMD_OPEN_BATCH,
+					OPEN_ATTR(0, 0, batch->stream));
+		if (ret) {
+			fprintf(stderr, "Unable to open batch: %i\n", ret);
+			xfer_queue_free(&batch->q);
+			return ret;
+		}
+
+		batch->open = true;
+		batch->nb_files = 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	ret = xfer_queue_write(&batch->q, &entry, sizeof(entry));
+	if (!ret)
+		ret = queue_extents(&batch->q, stream, manifest, crc, &ew);
+	if (ret) {
+		fprintf(stderr, "Unable to upload file: %i\n", ret);
+		return ret;
+	}
+
+	report_extents(&ew, stream->size, &start);
+
+	batch->files[batch->nb_files].id = id;
+	batch->files[batch->nb_files].size = stream->size;
+	batch->files[batch->nb_files].crc = *crc;
+	batch->nb_files++;
+
+	return 0;
+}
+
+/*
+ * Terminate the batch, wait until the device has written it, and check
+ * its files. Those that made it are added to the ones done.
+ */
+static int batch_close(struct batch *batch, struct upload_ctx *ctx)
+{
+	const struct transport *t = ctx->t;
+	struct batch_entry entry = { .file_id = BATCH_END };
+	bool open = batch->open;
+	unsigned int i, id;
+	char fn[256];
+	int ret = 0;
+
+	if (open) {
+		batch->open = false;
+
+		xfer_queue_write(&batch->q, &entry, sizeof(entry));
+		ret = xfer_queue_finish(&batch->q);
+	}
+
+	for (i = 0; i < batch->nb_streams; i++)
+		opk_stream_close(&batch->streams[i]);
+	batch->nb_streams = 0;
+
+	if (!open)
+		return 0;
+
+	if (ret) {
+		fprintf(stderr, "Unable to upload batch: %i\n", ret);
+		return ret;
+	}
+
+	ret = cmd_control_iface(t, CMD_CLOSE_FILE,
+				OPEN_ATTR(0, 0, batch->stream));
+	if (ret) {
+		fprintf(stderr, "Unable to close!\n");
+		return ret;
+	}
+
+	for (i = 0; i < batch->nb_files; i++) {
+		id = batch->files[i].id;
+
+		ret = cmd_verify_digest(t, id, batch->files[i].size,
+					batch->files[i].crc);
+		if (ret) {
+			get_stage2_path(fn, sizeof(fn), id, ctx->params);
+			fprintf(stderr, "Unable to verify %s: %i\n", fn, ret);
+			return ret;
+		}
+
+		pthread_mutex_lock(&ctx->lock);
+		*ctx->done |= 1 << id;
+		ctx->bytes += batch->files[i].size;
+		pthread_mutex_unlock(&ctx->lock);
+	}
+
+	return 0;
+}
+
+/*
+ * Skip the part of the file that the device kept from an interrupted
+ * transfer, if it has the same CRC32C as ours; '*crc' is then the CRC32C
+ * of that part. Returns -ESTALE if it differs, and the stream cannot be
+ * rewound.
+ */
+static int resume_stream(const struct transport *t, enum file_id id,
+			 const char *fn, struct opk_stream *stream,
+			 uint32_t *crc)
+{
+	unsigned char *buf = NULL;
+	const unsigned char *data;
+	struct resume resume;
+	ssize_t bytes_read;
+	size_t len;
+	int ret;
+
+	ret = cmd_control_iface_in(t, CMD_GET_RESUME, id, &resume,
+				   sizeof(resume), TIMEOUT_MS);
+	if (ret != sizeof(resume))
+		return 0;
+
+	resume.file_size = LE32(resume.file_size);
+	resume.offset = LE32(resume.offset);
+	resume.crc32c = LE32(resume.crc32c);
+
+	if (resume.file_size != stream->size || !resume.offset ||
+	    resume.offset > stream->size)
+		return 0;
+
+	if (!stream->data) {
+		buf = malloc(DEFAULT_BLOCK_SIZE);
+		if (!buf)
+			return -ENOMEM;
+	}
+
+	while (stream->offset < resume.offset) {
+		len = resume.offset - stream->offset;
+		if (len > DEFAULT_BLOCK_SIZE)
+			len = DEFAULT_BLOCK_SIZE;
+
+		bytes_read = opk_stream_get(stream, buf, len, &data);
+		if (bytes_read <= 0) {
+			free(buf);
+			return bytes_read < 0 ? bytes_read : -EIO;
+		}
+
+		*crc = crc32c(*crc, data, bytes_read);
+	}
+
+	free(buf);
+
+	if (*crc == resume.crc32c) {
+		printf("Resuming %s at %u of %u bytes\n",
+		       fn, resume.offset, resume.file_size);
+		return 0;
+	}
+
+	printf("%s changed since its upload was interrupted, sending it again\n",
+	       fn);
+
+	*crc = 0;
+
+	if (!stream->data)
+		return -ESTALE;
+
+	stream->offset = 0;
+
+	return 0;
+}
+
+static int open_stage2_file(struct upload_ctx *ctx, const char *fn,
+			    enum file_id id, struct opk_stream *stream)
+{
+	uint64_t start;
+	int ret;
+
+	/* The file is then in the cache, unless it could not be extracted */
+	if (ctx->params->prefetch) {
+		start = trace_begin();
+		prefetch_wait(ctx->params->prefetch, id);
+		trace_end(start, "wait", fn, 0);
+	}
+
+	ret = opk_stream_open(stream, ctx->params->opk, &opk_lock, fn);
+	if (ret < 0 && ret != -ENOENT)
+		fprintf(stderr, "Unable to extract data\n");
+
+	return ret;
+}
+
+/*
+ * Upload a stage-2 file, and check that the device has it. With a batch,
+ * the file is only queued, and checked when the batch is closed.
+ */
+static int load_from_opk(struct upload_ctx *ctx, const char *fn,
+			 enum file_id id, unsigned int stream_idx,
+			 struct batch *batch)
+{
+	const struct transport *t = ctx->t;
+	struct manifest manifest;
+	struct opk_stream stream;
+	uint32_t crc = 0;
+	uint64_t start;
+	int ret;
+
+	ret = open_stage2_file(ctx, fn, id, &stream);
+	if (ret < 0)
+		return ret;
+
+	ret = resume_stream(t, id, fn, &stream, &crc);
+	if (ret == -ESTALE) {
+		/* The start of the file was consumed checking it */
+		opk_stream_close(&stream);
+
+		ret = open_stage2_file(ctx, fn, id, &stream);
+		if (ret < 0)
+			return ret;
+	} else if (ret) {
+		fprintf(stderr, "Unable to resume %s: %i\n", fn, ret);
+		goto out_close_stream;
+	}
+
+	if (delta_updates) {
+		ret = cmd_get_manifest(t, id, &manifest);
+		if (ret) {
+			fprintf(stderr, "Unable to get manifest: %i\n", ret);
+			goto out_close_stream;
+		}
+	}
+
+	start = trace_begin();
+
+	if (batch) {
+		ret = batch_add(batch, t, &stream, id,
+				delta_updates ? &manifest : NULL, &crc);
+		if (!ret)
+			trace_end(start, "stage2", fn, stream.size);
+		if (delta_updates)
+			free(manifest.hashes);
+		return ret;
+	}
+
+	ret = upload_file(t, &stream, id, stream_idx,
+			  delta_updates ? &manifest : NULL, &crc);
+	if (ret)
+		goto out_free_manifest;
+
+	ret = cmd_verify_digest(t, id, stream.size, crc);
+	if (ret) {
+		fprintf(stderr, "Unable to verify %s: %i\n", fn, ret);
+		goto out_free_manifest;
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->bytes += stream.size;
+	pthread_mutex_unlock(&ctx->lock);
+
+	trace_end(start, "stage2", fn, stream.size);
+
+out_free_manifest:
+	if (delta_updates)
+		free(manifest.hashes);
+out_close_stream:
+	opk_stream_close(&stream);
+	return ret;
+}
+
+/*
+ * Find the bulk OUT endpoints exposed by odbootd, one per stream. The
+ * local transport numbers its endpoints from 1.
+ */
+static void find_streams(struct transport *t)
+{
+	const struct libusb_interface_descriptor *intf;
+	struct libusb_config_descriptor *config;
+	unsigned int i;
+	uint8_t attr, addr;
+
+	t->nb_streams = 0;
+
+	if (t->local) {
+		for (; t->nb_streams < t->local->nb_eps &&
+		     t->nb_streams < MAX_STREAMS; t->nb_streams++)
+			t->endpoints[t->nb_streams] =
+				LIBUSB_ENDPOINT_OUT | (t->nb_streams + 1);
+	} else if (!libusb_get_active_config_descriptor(libusb_get_device(t->hdl),
+							&config)) {
+		if (config->bNumInterfaces && config->interface[0].num_altsetting) {
+			intf = &config->interface[0].altsetting[0];
+
+			for (i = 0; i < intf->bNumEndpoints &&
+			     t->nb_streams < MAX_STREAMS; i++) {
+				attr = intf->endpoint[i].bmAttributes;
+				addr = intf->endpoint[i].bEndpointAddress;
+
+				if ((attr & LIBUSB_TRANSFER_TYPE_MASK) == LIBUSB_TRANSFER_TYPE_BULK &&
+				    (addr & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT)
+					t->endpoints[t->nb_streams++] = addr;
+			}
+		}
+
+		libusb_free_config_descriptor(config);
+	}
+
+	/* Older odbootd only had ep1 */
+	if (!t->nb_streams) {
+		t->endpoints[0] = LIBUSB_ENDPOINT_OUT | 1;
+		t->nb_streams = 1;
+	}
+}
+
+static void * upload_worker(void *d)
+{
+	struct upload_worker *worker = d;
+	struct upload_ctx *ctx = worker->ctx;
+	struct batch batch = { .stream = worker->stream };
+	unsigned int id, done;
+	char buf[256];
+	int ret;
+
+	trace_thread_name("stream %u", worker->stream);
+
+	for (;;) {
+		pthread_mutex_lock(&ctx->lock);
+		id = ctx->next++;
+		ret = ctx->status;
+		done = *ctx->done;
+		pthread_mutex_unlock(&ctx->lock);
+
+		if (ret || id >= ARRAY_SIZE(files_to_upload))
+			break;
+
+		if (done & (1 << id))
+			continue;
+
+		get_stage2_path(buf, sizeof(buf), id, ctx->params);
+
+		ret = load_from_opk(ctx, buf, id, worker->stream,
+				    ctx->t->batch ? &batch : NULL);
+
+		/* The files of a batch are done once it is closed */
+		pthread_mutex_lock(&ctx->lock);
+		if ((!ret && !ctx->t->batch) || ret == -ENOENT)
+			*ctx->done |= 1 << id;
+		else if (ret && !ctx->status)
+			ctx->status = ret;
+		pthread_mutex_unlock(&ctx->lock);
+	}
+
+	ret = batch_close(&batch, ctx);
+	if (ret) {
+		pthread_mutex_lock(&ctx->lock);
+		if (!ctx->status)
+			ctx->status = ret;
+		pthread_mutex_unlock(&ctx->lock);
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->nb_running--;
+	pthread_cond_signal(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+
+	return NULL;
+}
+
+/*
+ * Print the progress of the upload as seen by odbootd, and its throughput
+ * since the last call. Returns an error if odbootd has no statistics.
+ */
+static int print_device_stats(const struct transport *t, uint64_t *last_bytes,
+			      struct timespec *last)
+{
+	struct device_stats stats[MAX_STREAMS];
+	uint32_t max_chunk_us = 0, nb_stalls = 0;
+	unsigned int i, nb;
+	uint64_t bytes = 0;
+	double secs;
+	int ret;
+
+	ret = cmd_control_iface_in(t, CMD_GET_STATS, 0, stats, sizeof(stats),
+				   TIMEOUT_MS);
+	if (ret < (int)sizeof(stats[0]))
+		return ret < 0 ? ret : -ENOSYS;
+
+	nb = ret / sizeof(stats[0]);
+
+	for (i = 0; i < nb; i++) {
+		bytes += LE64(stats[i].total_bytes);
+		nb_stalls += LE32(stats[i].nb_stalls);
+		if (LE32(stats[i].max_chunk_us) > max_chunk_us)
+			max_chunk_us = LE32(stats[i].max_chunk_us);
+	}
+
+	secs = elapsed_sec(last);
+	clock_gettime(CLOCK_MONOTONIC, last);
+
+	printf("Device: %.1f MiB received (%.2f MB/s), %u stalls, "
+	       "slowest chunk %u ms\n", bytes / (1024.0 * 1024.0),
+	       secs > 0.0 ? (bytes - *last_bytes) / secs / 1e6 : 0.0,
+	       nb_stalls, max_chunk_us / 1000);
+
+	*last_bytes = bytes;
+
+	return 0;
+}
+
+/*
+ * Upload the stage-2 files, spreading them across all the streams that
+ * odbootd exposes. The workers take the files in order, so the small
+ * files are not waiting behind the rootfs. The files flagged in 'done'
+ * are skipped, and the ones uploaded are added to it.
+ */
+static int upload_stage2(const struct transport *t,
+			 const struct flash_params *params,
+			 unsigned int *done, size_t *bytes)
+{
+	struct upload_worker workers[MAX_STREAMS];
+	unsigned int i, nb_workers;
+	struct upload_ctx ctx = {
+		.t = t,
+		.params = params,
+		.done = done,
+	};
+	struct timespec deadline, last;
+	uint64_t last_bytes = 0;
+	bool show_stats = true;
+	int ret;
+
+	pthread_mutex_init(&ctx.lock, NULL);
+	pthread_cond_init(&ctx.cond, NULL);
+
+	nb_workers = t->nb_streams;
+	if (nb_workers > ARRAY_SIZE(files_to_upload))
+		nb_workers = ARRAY_SIZE(files_to_upload);
+
+	printf("Uploading over %u stream(s)\n", nb_workers);
+
+	for (i = 0; i < nb_workers; i++) {
+		workers[i].ctx = &ctx;
+		workers[i].stream = i;
+
+		pthread_mutex_lock(&ctx.lock);
+		ret = pthread_create(&workers[i].thd, NULL,
+				     upload_worker, &workers[i]);
+		if (ret)
+			ctx.status = -ret;
+		else
+			ctx.nb_running++;
+		pthread_mutex_unlock(&ctx.lock);
+
+		if (ret)
+			break;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &last);
+
+	/* Show the device's side of the upload while the workers run */
+	pthread_mutex_lock(&ctx.lock);
+	while (ctx.nb_running) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += STATS_INTERVAL_S;
+
+		ret = pthread_cond_timedwait(&ctx.cond, &ctx.lock, &deadline);
+		if (ret != ETIMEDOUT || !show_stats)
+			continue;
+
+		pthread_mutex_unlock(&ctx.lock);
+		show_stats = !print_device_stats(t, &last_bytes, &last);
+		pthread_mutex_lock(&ctx.lock);
+	}
+	pthread_mutex_unlock(&ctx.lock);
+
+	while (i--)
+		pthread_join(workers[i].thd, NULL);
+
+	pthread_cond_destroy(&ctx.cond);
+	pthread_mutex_destroy(&ctx.lock);
+
+	*bytes += ctx.bytes;
+
+	return ctx.status;
+}
+
+static const unsigned int calib_chunk_sizes[] = {
+	64 * 1024, 256 * 1024, 1024 * 1024, 4096 * 1024,
+};
+static const unsigned int calib_queue_depths[] = { 2, 4, 8, 16 };
+static const unsigned int calib_rx_buf_sizes[] = {
+	16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024,
+};
+static const unsigned int calib_rx_depths[] = { 4, 8, 16, 32 };
+
+/* Calibrated one after the other, each one keeping the best of the others */
+static const struct {
+	const char *name;
+	const unsigned int *values;
+	unsigned int nb_values;
+	size_t offset;
+} calib_axes[] = {
+	{ "chunk size", calib_chunk_sizes, ARRAY_SIZE(calib_chunk_sizes),
+		offsetof(struct profile, chunk_size) },
+	{ "queue depth", calib_queue_depths, ARRAY_SIZE(calib_queue_depths),
+		offsetof(struct profile, queue_depth) },
+	{ "device read size", calib_rx_buf_sizes, ARRAY_SIZE(calib_rx_buf_sizes),
+		offsetof(struct profile, rx_buf_size) },
+	{ "device read depth", calib_rx_depths, ARRAY_SIZE(calib_rx_depths),
+		offsetof(struct profile, rx_depth) },
+};
+
+static const char * link_speed(libusb_device_handle *hdl)
+{
+	switch (libusb_get_device_speed(libusb_get_device(hdl))) {
+	case LIBUSB_SPEED_LOW:
+		return "low";
+	case LIBUSB_SPEED_FULL:
+		return "full";
+	case LIBUSB_SPEED_HIGH:
+		return "high";
+	case LIBUSB_SPEED_SUPER:
+		return "super";
+	default:
+		return "unknown";
+	}
+}
+
+/*
+ * Find out what the device supports, and its streams. The stage-2 files
+ * are compressed on full-speed links, where the device decompresses faster
+ * than USB carries the data, or when asked to.
+ */
+static void setup_features(struct transport *t, const char *speed)
+{
+	uint32_t features;
+	int ret;
+
+	ret = cmd_control_iface_in(t, CMD_GET_FEATURES, 0, &features,
+				   sizeof(features), TIMEOUT_MS);
+	if (ret != sizeof(features))
+		features = 0;
+
+	features = LE32(features);
+
+	t->batch = !!(features & FEATURE_BATCH);
+	t->scratch = !!(features & FEATURE_SCRATCH);
+	t->abort = !!(features & FEATURE_ABORT);
+
+	find_streams(t);
+
+	if (!force_compression && strcmp(speed, "low") && strcmp(speed, "full"))
+		return;
+
+	if (!(features & FEATURE_LZ4)) {
+		printf("Device does not support compression\n");
+		return;
+	}
+
+	printf("Compressing the stage-2 files with LZ4\n");
+	t->compress = true;
+}
+
+/* Use the parameters of a profile for the next uploads */
+static int set_xfer_params(struct transport *t, const struct profile *p)
+{
+	int ret;
+
+	if (!p->chunk_size || p->chunk_size > 64 * 1024 * 1024 ||
+	    !p->queue_depth || p->queue_depth > MAX_QUEUE_DEPTH ||
+	    p->rx_buf_size / 1024 > MAX_PARAM_VALUE ||
+	    p->rx_depth > MAX_PARAM_VALUE ||
+	    p->rx_buf_size * p->rx_depth > MAX_RX_QUEUE_SIZE)
+		return -EINVAL;
+
+	t->chunk_size = p->chunk_size;
+	t->queue_depth = p->queue_depth;
+	t->xfer = *p;
+
+	/* Zero leaves the device's own settings */
+	if (p->rx_buf_size >= 1024) {
+		ret = cmd_control_iface(t, CMD_SET_PARAM,
+					PARAM_ATTR(PARAM_RX_BUF_SIZE,
+						   p->rx_buf_size / 1024));
+		if (ret)
+			return ret;
+	}
+
+	if (p->rx_depth) {
+		ret = cmd_control_iface(t, CMD_SET_PARAM,
+					PARAM_ATTR(PARAM_RX_DEPTH, p->rx_depth));
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* Upload 'size' bytes of synthetic data, and measure the throughput */
+static int calibrate_run(struct transport *t, struct profile *p,
+			 const unsigned char *data, size_t size)
+{
+	struct opk_stream stream = {
+		.size = size,
+		.data = (void *)data,
+		.shared = true,
+		.file_fd = -1,
+#ifndef _WIN32
+		.pid = -1,
+#endif
+	};
+	struct timespec start;
+	uint32_t crc = 0;
+	double secs;
+	int ret;
+
+	ret = set_xfer_params(t, p);
+	if (ret)
+		return ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	ret = upload_file(t, &stream, ID_SCRATCH, 0, NULL, &crc);
+	if (ret)
+		return ret;
+
+	secs = elapsed_sec(&start);
+
+	ret = cmd_verify_digest(t, ID_SCRATCH, size, crc);
+	if (ret)
+		return ret;
+
+	p->mbps = secs > 0.0 ? size / secs / 1e6 : 0.0;
+
+	printf("  chunk %5u KiB, depth %2u, device reads %4u KiB x %2u: %8.2f MB/s\n",
+	       p->chunk_size / 1024, p->queue_depth, p->rx_buf_size / 1024,
+	       p->rx_depth, p->mbps);
+
+	return 0;
+}
+
+/*
+ * Sweep the transfer parameters one at a time, uploading synthetic data
+ * to the device's scratch file. Returns the fastest combination in 'best'.
+ */
+static int calibrate(struct transport *t, struct profile *best)
+{
+	unsigned int i, v, *field;
+	unsigned char *data;
+	uint64_t seed = 0x9e3779b97f4a7c15ull;
+	struct profile p;
+	size_t j;
+	int ret;
+
+	if (!t->scratch) {
+		fprintf(stderr, "Device has no scratch file to calibrate with\n");
+		return -ENOTSUP;
+	}
+
+	/* Incompressible and without zero pages, so that all of it is sent */
+	data = malloc(CALIBRATION_SIZE);
+	if (!data)
+		return -ENOMEM;
+
+	for (j = 0; j < CALIBRATION_SIZE; j++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		data[j] = seed | 1;
+	}
+
+	printf("Calibrating with %u MiB uploads\n", CALIBRATION_SIZE >> 20);
+
+	*best = (struct profile) {
+		.chunk_size = chunk_size,
+		.queue_depth = queue_depth,
+		.rx_buf_size = calib_rx_buf_sizes[1],
+		.rx_depth = calib_rx_depths[1],
+	};
+
+	ret = calibrate_run(t, best, data, CALIBRATION_SIZE);
+	if (ret)
+		goto out_free;
+
+	for (i = 0; i < ARRAY_SIZE(calib_axes); i++) {
+		for (v = 0; v < calib_axes[i].nb_values; v++) {
+			p = *best;
+			field = (unsigned int *)((char *)&p + calib_axes[i].offset);
+
+			/* Already measured */
+			if (*field == calib_axes[i].values[v])
+				continue;
+
+			*field = calib_axes[i].values[v];
+
+			/* More than the device would queue */
+			if (p.rx_buf_size * p.rx_depth > MAX_RX_QUEUE_SIZE)
+				continue;
+
+			ret = calibrate_run(t, &p, data, CALIBRATION_SIZE);
+			if (ret)
+				goto out_free;
+
+			if (p.mbps > best->mbps)
+				*best = p;
+		}
+	}
+
+	printf("Best: chunk %u KiB, depth %u, device reads %u KiB x %u (%.2f MB/s)\n",
+	       best->chunk_size / 1024, best->queue_depth,
+	       best->rx_buf_size / 1024, best->rx_depth, best->mbps);
+
+out_free:
+	free(data);
+	return ret;
+}
+
+/*
+ * Pick the parameters of the stage-2 upload: calibrate them if asked to,
+ * or use the profile saved for this board group and link speed, unless
+ * they were given on the command line.
+ */
+static int setup_xfer_params(struct transport *t,
+			     const struct flash_params *params,
+			     const char *speed)
+{
+	const char *group = params->group->code;
+	struct profile p;
+	int ret;
+
+	if (calibrate_xfer) {
+		ret = calibrate(t, &p);
+		if (ret) {
+			fprintf(stderr, "Calibration failed: %i\n", ret);
+			return ret;
+		}
+
+		if (profile_path[0]) {
+			pthread_mutex_lock(&profile_lock);
+			ret = profile_store(profile_path, group, speed, &p);
+			pthread_mutex_unlock(&profile_lock);
+
+			if (ret)
+				fprintf(stderr, "Unable to save profile: %s\n",
+					strerror(-ret));
+			else
+				printf("Saved profile for %s at %s speed to %s\n",
+				       group, speed, profile_path);
+		}
+	} else if (user_xfer_params || !profile_path[0]) {
+		return 0;
+	} else {
+		pthread_mutex_lock(&profile_lock);
+		ret = profile_load(profile_path, group, speed, &p);
+		pthread_mutex_unlock(&profile_lock);
+
+		if (ret)
+			return 0;
+
+		printf("Using the profile for %s at %s speed: chunk %u KiB, depth %u\n",
+		       group, speed, p.chunk_size / 1024, p.queue_depth);
+	}
+
+	ret = set_xfer_params(t, &p);
+	if (ret)
+		fprintf(stderr, "Unable to set transfer parameters: %i\n", ret);
+
+	return ret;
+}
+
+/*
+ * odbootd may still be waiting for the rest of the files of the lost link,
+ * and would refuse to open them again until told to stop.
+ */
+static int abort_transfers(struct transport *t)
+{
+	if (!t->abort)
+		return 0;
+
+	return cmd_control_iface(t, CMD_ABORT, 0);
+}
+
+/* odbootd may have gone back to its own parameters after a reconnection */
+static int restore_xfer_params(struct transport *t)
+{
+	struct profile p = t->xfer;
+
+	if (!p.chunk_size)
+		return 0;
+
+	return set_xfer_params(t, &p);
+}
+
+/*
+ * Whether an upload failed because the link to odbootd went away. Failed
+ * socket writes are reported like failed USB transfers.
+ */
+static bool link_lost(const struct transport *t, int ret)
+{
+	if (t->local)
+		return ret == LIBUSB_ERROR_IO || ret == -EPIPE ||
+			ret == -ECONNRESET || ret == -EIO;
+
+	return ret == LIBUSB_ERROR_NO_DEVICE || ret == LIBUSB_ERROR_IO ||
+		ret == LIBUSB_ERROR_PIPE || ret == LIBUSB_ERROR_TIMEOUT;
+}
+
+static void session_name(struct session *s)
+{
+	int i, len;
+
+	len = snprintf(s->name, sizeof(s->name), "%u-", s->bus);
+
+	for (i = 0; i < s->nb_ports && len < (int)sizeof(s->name); i++) {
+		len += snprintf(s->name + len, sizeof(s->name) - len,
+				i ? ".%u" : "%u", s->ports[i]);
+	}
+}
+
+static bool session_match(const struct session *s, libusb_device *dev)
+{
+	uint8_t ports[7];
+	int nb_ports;
+
+	if (libusb_get_bus_number(dev) != s->bus)
+		return false;
+
+	nb_ports = libusb_get_port_numbers(dev, ports, sizeof(ports));
+
+	return nb_ports == s->nb_ports && !memcmp(ports, s->ports, nb_ports);
+}
+
+static bool device_match(libusb_device *dev, const struct board_group *group)
+{
+	struct libusb_device_descriptor desc;
+
+	if (libusb_get_device_descriptor(dev, &desc))
+		return false;
+
+	return desc.idVendor == group->vid && desc.idProduct == group->pid;
+}
+
+/*
+ * Find the devices in bootrom mode, and create one session per device.
+ * Unless 'all' is set, only the first device found is used.
+ */
+static int find_devices(const struct flash_params *params, bool all,
+			struct session **out)
+{
+	struct session *sessions;
+	libusb_device **list;
+	ssize_t i, nb_devs;
+	int nb = 0;
+
+	nb_devs = libusb_get_device_list(usb_ctx, &list);
+	if (nb_devs < 0)
+		return nb_devs;
+
+	sessions = calloc(nb_devs ? nb_devs : 1, sizeof(*sessions));
+	if (!sessions) {
+		libusb_free_device_list(list, 1);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < nb_devs; i++) {
+		struct session *s = &sessions[nb];
+
+		if (!device_match(list[i], params->group))
+			continue;
+
+		s->params = params;
+		s->dev = libusb_ref_device(list[i]);
+		s->bus = libusb_get_bus_number(list[i]);
+		s->nb_ports = libusb_get_port_numbers(list[i], s->ports,
+						      sizeof(s->ports));
+		s->step = "pending";
+		session_name(s);
+		nb++;
+
+		if (!all)
+			break;
+	}
+
+	libusb_free_device_list(list, 1);
+
+	*out = sessions;
+
+	return nb;
+}
+
+static int session_hotplug_cb(libusb_context *ctx, libusb_device *dev,
+			      libusb_hotplug_event event, void *d)
+{
+	struct session *s = d;
+
+	if (s->arrived || !session_match(s, dev))
+		return 0;
+
+	s->new_dev = libusb_ref_device(dev);
+	s->arrived = 1;
+
+	/* Deregister the callback */
+	return 1;
+}
+
+/*
+ * Start watching for the device to come back before it goes away, so that
+ * no arrival event can be missed. Without hotplug support, fall back to
+ * polling the device list.
+ */
+static void session_watch(struct session *s)
+{
+	s->address = libusb_get_device_address(s->dev);
+	s->arrived = 0;
+	s->hotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+		!libusb_hotplug_register_callback(usb_ctx,
+				LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+				LIBUSB_HOTPLUG_NO_FLAGS,
+				s->params->group->vid, s->params->group->pid,
+				LIBUSB_HOTPLUG_MATCH_ANY,
+				session_hotplug_cb, s, &s->hotplug_cb);
+}
+
+static void session_unwatch(struct session *s)
+{
+	if (s->hotplug)
+		libusb_hotplug_deregister_callback(usb_ctx, s->hotplug_cb);
+
+	s->hotplug = false;
+}
+
+static libusb_device_handle * session_wait_hotplug(struct session *s,
+						   const struct timespec *start)
+{
+	libusb_device_handle *hdl = NULL;
+	struct timeval tv;
+
+	while (!s->arrived && elapsed_sec(start) < RECONNECT_TIMEOUT_S) {
+		tv.tv_sec = 0;
+		tv.tv_usec = RECONNECT_POLL_MS * 1000;
+
+		libusb_handle_events_timeout_completed(usb_ctx, &tv,
+						       &s->arrived);
+	}
+
+	session_unwatch(s);
+
+	if (!s->arrived)
+		return NULL;
+
+	/* The device node may not be accessible right away */
+	while (libusb_open(s->new_dev, &hdl) &&
+	       elapsed_sec(start) < RECONNECT_TIMEOUT_S)
+		usleep(RECONNECT_POLL_MS * 1000);
+
+	libusb_unref_device(s->new_dev);
+
+	return hdl;
+}
+
+static libusb_device_handle * session_wait_poll(struct session *s,
+						const struct timespec *start)
+{
+	libusb_device_handle *hdl = NULL;
+	libusb_device **list;
+	ssize_t i, nb_devs;
+	bool gone = false, seen;
+
+	while (!hdl && elapsed_sec(start) < RECONNECT_TIMEOUT_S) {
+		nb_devs = libusb_get_device_list(usb_ctx, &list);
+		seen = false;
+
+		for (i = 0; i < nb_devs; i++) {
+			if (!device_match(list[i], s->params->group) ||
+			    !session_match(s, list[i]))
+				continue;
+
+			/* Skip the old device until it has disconnected */
+			if (!gone &&
+			    libusb_get_device_address(list[i]) == s->address) {
+				seen = true;
+				continue;
+			}
+
+			if (!libusb_open(list[i], &hdl))
+				break;
+		}
+
+		if (nb_devs >= 0) {
+			libusb_free_device_list(list, 1);
+			gone |= !seen;
+		}
+
+		if (!hdl)
+			usleep(RECONNECT_POLL_MS * 1000);
+	}
+
+	return hdl;
+}
+
+/*
+ * The USB device will disconnect, and reconnect a bit later.
+ * Wait for the new USB device to appear on the same port.
+ */
+static libusb_device_handle * session_reconnect(struct session *s)
+{
+	libusb_device_handle *hdl;
+	uint64_t trace_start = trace_begin();
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (s->hotplug)
+		hdl = session_wait_hotplug(s, &start);
+	else
+		hdl = session_wait_poll(s, &start);
+
+	s->reconnect_secs = elapsed_sec(&start);
+
+	trace_end(trace_start, "reconnect", s->name, 0);
+
+	return hdl;
+}
+
+/*
+ * The link was lost while uploading the stage-2 files, usually because of
+ * a glitch on the cable, but odbootd is still running. Wait for it to come
+ * back on the same port; it may be back already, so the device list is
+ * polled instead of waiting for a hotplug event.
+ */
+static libusb_device_handle * session_relink(struct session *s,
+					     libusb_device_handle *hdl)
+{
+	s->address = libusb_get_device_address(libusb_get_device(hdl));
+	s->hotplug = false;
+
+	libusb_close(hdl);
+
+	return session_reconnect(s);
+}
+
+static int flash_device(struct session *s)
+{
+	const struct flash_params *params = s->params;
+	struct transport t = { 0 };
+	libusb_device_handle *hdl;
+	unsigned int i, attempt, done = 0;
+	uint64_t start;
+	int ret;
+
+	s->step = "stage1";
+	start = trace_begin();
+
+	ret = libusb_open(s->dev, &hdl);
+	if (ret) {
+		fprintf(stderr, "[%s] Unable to open device\n", s->name);
+		return ret;
+	}
+
+	ret = libusb_claim_interface(hdl, 0);
+	if (ret) {
+		fprintf(stderr, "[%s] Unable to claim interface 0\n", s->name);
+		goto out_close_dev_handle;
+	}
+
+	ret = cmd_get_info(hdl);
+	if (ret) {
+		fprintf(stderr, "[%s] Unable to read CPU info\n", s->name);
+		goto out_close_dev_handle;
+	}
+
+	ret = cmd_load_data(hdl, params->stage1.data, 0x80000000,
+			    params->stage1.size, true);
+	if (ret) {
+		fprintf(stderr, "[%s] Unable to upload stage1 bootloader\n",
+			s->name);
+		goto out_close_dev_handle;
+	}
+
+	s->bytes += params->stage1.size;
+	printf("[%s] Uploaded bootloader\n", s->name);
+
+	ret = cmd_control(hdl, CMD_START1, 0x80000000);
+	if (ret) {
+		fprintf(stderr, "[%s] Unable to execute stage1 bootloader\n",
+			s->name);
+		goto out_close_dev_handle;
+	}
+
+	trace_end(start, "stage1", "stage1", params->stage1.size);
+	start = trace_begin();
+
+	/* Wait for stage1 to complete operation */
+	for (i = 0; i < 100; i++) {
+		if (!cmd_get_info(hdl))
+			break;
+
+		usleep(10000); /* 10ms * 100 = 1s */
+	}
+
+	if (i == 100) {
+		fprintf(stderr, "[%s] Stage1 bootloader did not return.\n",
+			s->name);
+		ret = -ETIMEDOUT;
+		goto out_close_dev_handle;
+	}
 
-	ret = opk_extract_file(opk, buf, &data, &data_size);
-	if (ret < 0) {
-		fprintf(stderr, "Unable to extract DTB\n");
-		goto err_close_opk;
+	trace_end(start, "poll", "stage1", 0);
+
+	s->step = "kernel";
+	start = trace_begin();
+
+	ret = cmd_load_data(hdl, (unsigned char *)params->kernel, 0x81000000,
+			    params->kernel_size, true);
+	if (ret) {
+		fprintf(stderr, "[%s] Unable to upload kernel\n", s->name);
+		goto out_close_dev_handle;
 	}
 
-	ret = cmd_load_data(hdl, data, 0x81000000 + kernel_size, data_size, true);
-	free(data);
+	s->bytes += params->kernel_size;
+	printf("[%s] Uploaded kernel\n", s->name);
 
+	ret = cmd_load_data(hdl, params->dtb.data,
+			    0x81000000 + params->kernel_size,
+			    params->dtb.size, true);
 	if (ret) {
-		fprintf(stderr, "Unable to upload devicetree\n");
+		fprintf(stderr, "[%s] Unable to upload devicetree\n", s->name);
 		goto out_close_dev_handle;
 	}
 
+	s->bytes += params->dtb.size;
+
+	trace_end(start, "kernel", "kernel",
+		  params->kernel_size + params->dtb.size);
+
 	ret = cmd_control(hdl, CMD_FLUSH_CACHES, 0);
 	if (ret) {
-		fprintf(stderr, "Unable to flush caches\n");
+		fprintf(stderr, "[%s] Unable to flush caches\n", s->name);
 		goto out_close_dev_handle;
 	}
 
+	session_watch(s);
+
 	ret = cmd_control(hdl, CMD_START2, 0x81000000);
 	if (ret) {
-		fprintf(stderr, "Unable to execute program\n");
+		fprintf(stderr, "[%s] Unable to execute program\n", s->name);
+		session_unwatch(s);
 		goto out_close_dev_handle;
 	}
 
-	printf("Operation suceeded.\n");
+	printf("[%s] Operation suceeded.\n", s->name);
 
-	/*
-	 * The USB device will disconnect, and reconnect a bit later.
-	 * Wait for the new USB device to appear.
-	 */
 	libusb_close(hdl);
-	libusb_exit(usb_ctx);
-	sleep(5);
 
-	ret = libusb_init(&usb_ctx);
-	if (ret) {
-		fprintf(stderr, "Unable to init libusb\n");
-		return ret;
-	}
+	s->step = "reconnect";
 
-	for (;;) {
-		hdl = libusb_open_device_with_vid_pid(usb_ctx,
-						      groups[group].vid,
-						      groups[group].pid);
-		if (hdl)
-			break;
-		sleep(1);
+	hdl = session_reconnect(s);
+	if (!hdl) {
+		fprintf(stderr, "[%s] Device did not come back\n", s->name);
+		return -ETIMEDOUT;
 	}
 
+	printf("[%s] Reconnected after %.2fs\n", s->name, s->reconnect_secs);
+
 	ret = libusb_claim_interface(hdl, 0);
 	if (ret) {
-		fprintf(stderr, "Unable to claim interface 0\n");
+		fprintf(stderr, "[%s] Unable to claim interface 0\n", s->name);
 		goto out_close_dev_handle;
 	}
 
-	for (i = 0; i < ARRAY_SIZE(files_to_upload); i++) {
-		if (files_to_upload[i]) {
-			snprintf(buf, sizeof(buf), "%s/%s",
-				 boardname, files_to_upload[i]);
-		} else if (i == ID_DTB) {
-			snprintf(buf, sizeof(buf), "%s/%s.dtb",
-				 boardname,
-				 groups[group].boards[board].dts_code);
-		} else if (i == ID_UBIBOOT) {
-			snprintf(buf, sizeof(buf), "%s/ubiboot-%s.bin",
-				 boardname,
-				 groups[group].boards[board].btl_code);
-		}
+	s->step = "stage2";
+	t.hdl = hdl;
 
-		ret = load_from_opk(hdl, opk, buf, i);
-		if (ret) {
-			if (ret == -ENOENT)
-				continue;
-			goto out_close_dev_handle;
+	setup_features(&t, link_speed(hdl));
+
+	ret = setup_xfer_params(&t, params, link_speed(hdl));
+	if (ret)
+		goto out_close_dev_handle;
+
+	/* After losing the device, resume where the upload stopped */
+	for (attempt = 0; ; attempt++) {
+		ret = upload_stage2(&t, params, &done, &s->bytes);
+		if (!ret || attempt == MAX_RESUMES || !link_lost(&t, ret))
+			break;
+
+		fprintf(stderr, "[%s] Lost the device, waiting for it to come back\n",
+			s->name);
+
+		hdl = session_relink(s, hdl);
+		if (!hdl) {
+			fprintf(stderr, "[%s] Device did not come back\n", s->name);
+			return -ETIMEDOUT;
 		}
+
+		printf("[%s] Reconnected after %.2fs\n",
+		       s->name, s->reconnect_secs);
+
+		t.hdl = hdl;
+
+		ret = libusb_claim_interface(hdl, 0);
+		if (!ret)
+			ret = abort_transfers(&t);
+		if (!ret)
+			ret = restore_xfer_params(&t);
+		if (ret)
+			break;
 	}
+	if (ret)
+		goto out_close_dev_handle;
 
 	/* Exit */
-	ret = cmd_control_iface(hdl, CMD_EXIT, 0);
+	ret = cmd_control_iface(&t, CMD_EXIT, 0);
 	if (ret) {
-		fprintf(stderr, "Unable to close!\n");
+		fprintf(stderr, "[%s] Unable to close!\n", s->name);
 		goto out_close_dev_handle;
 	}
 
+	s->step = "done";
+
 out_close_dev_handle:
 	libusb_close(hdl);
+	return ret;
+}
+
+static void * session_thread(void *d)
+{
+	struct session *s = d;
+	struct timespec start;
+
+	trace_thread_name("%s", s->name);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	s->ret = flash_device(s);
+	s->secs = elapsed_sec(&start);
+
+	return NULL;
+}
+
+static void print_sessions(const struct session *sessions, unsigned int nb)
+{
+	unsigned int i;
+
+	printf("\n%-16s %-10s %-12s %12s %8s %8s %10s\n",
+	       "Device", "Status", "Step", "Bytes", "Time", "MB/s", "Reconnect");
+
+	for (i = 0; i < nb; i++) {
+		const struct session *s = &sessions[i];
+
+		printf("%-16s %-10s %-12s %12lu %7.1fs %8.2f %9.2fs\n",
+		       s->name, s->ret ? "FAILED" : "OK", s->step,
+		       (unsigned long)s->bytes, s->secs,
+		       s->secs > 0.0 ? s->bytes / s->secs / 1e6 : 0.0,
+		       s->reconnect_secs);
+	}
+}
+
+/*
+ * Add a file to the cache. Going through an opk_stream, only a block of
+ * it is in memory at a time when unsquashfs can stream it; libopk still
+ * extracts it whole, but it is freed once cached.
+ */
+static void prefetch_file(struct OPK *opk, pthread_mutex_t *lock,
+			  const char *fn)
+{
+	struct opk_stream stream;
+	const unsigned char *data;
+	unsigned char *block;
+	uint64_t start = trace_begin();
+	ssize_t ret;
+
+	block = malloc(DEFAULT_BLOCK_SIZE);
+	if (!block)
+		return;
+
+	if (opk_stream_open(&stream, opk, lock, fn) < 0) {
+		free(block);
+		return;
+	}
+
+	while (stream.offset < stream.size) {
+		ret = opk_stream_get(&stream, block, DEFAULT_BLOCK_SIZE, &data);
+		if (ret <= 0)
+			break;
+	}
+
+	opk_stream_close(&stream);
+	free(block);
+
+	trace_end(start, "prefetch", fn, stream.size);
+}
+
+static void * prefetch_thread(void *d)
+{
+	struct prefetch *prefetch = d;
+	pthread_mutex_t *lock = NULL;
+	struct OPK *opk;
+	unsigned int id;
+	char buf[256];
+
+	trace_thread_name("prefetch");
+
+	/* With a handle of its own, each thread can extract in parallel */
+	opk = opk_open(opk_filename);
+	if (!opk) {
+		opk = prefetch->params->opk;
+		lock = &opk_lock;
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&prefetch->lock);
+		id = prefetch->next++;
+		if (prefetch->stop)
+			id = ARRAY_SIZE(files_to_upload);
+		pthread_mutex_unlock(&prefetch->lock);
+
+		if (id >= ARRAY_SIZE(files_to_upload))
+			break;
+
+		get_stage2_path(buf, sizeof(buf), id, prefetch->params);
+		prefetch_file(opk, lock, buf);
+
+		pthread_mutex_lock(&prefetch->lock);
+		prefetch->ready[id] = true;
+		pthread_cond_broadcast(&prefetch->cond);
+		pthread_mutex_unlock(&prefetch->lock);
+	}
+
+	if (!lock)
+		opk_close(opk);
+
+	return NULL;
+}
+
+static unsigned int nb_host_cpus(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+	long nb = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (nb > 0)
+		return nb;
+#endif
+
+	return 2;
+}
+
+/*
+ * Start extracting all the stage-2 files into the cache on worker threads,
+ * so that the extraction overlaps the boot of the device. All the sessions
+ * then map the same cached files.
+ */
+static int prefetch_start(struct flash_params *params)
+{
+	struct prefetch *prefetch;
+	unsigned int i, nb_thds;
+	int ret;
+
+	prefetch = calloc(1, sizeof(*prefetch));
+	if (!prefetch)
+		return -ENOMEM;
+
+	pthread_mutex_init(&prefetch->lock, NULL);
+	pthread_cond_init(&prefetch->cond, NULL);
+	prefetch->params = params;
+
+	nb_thds = nb_host_cpus();
+	if (nb_thds > ARRAY_SIZE(files_to_upload))
+		nb_thds = ARRAY_SIZE(files_to_upload);
+	if (nb_thds > MAX_PREFETCH_THREADS)
+		nb_thds = MAX_PREFETCH_THREADS;
+
+	for (i = 0; i < nb_thds; i++) {
+		ret = pthread_create(&prefetch->thds[i], NULL,
+				     prefetch_thread, prefetch);
+		if (ret)
+			break;
+	}
+
+	if (!i) {
+		pthread_cond_destroy(&prefetch->cond);
+		pthread_mutex_destroy(&prefetch->lock);
+		free(prefetch);
+		return -ret;
+	}
+
+	prefetch->nb_thds = i;
+	params->prefetch = prefetch;
+
+	return 0;
+}
+
+static void prefetch_stop(struct flash_params *params)
+{
+	struct prefetch *prefetch = params->prefetch;
+	unsigned int i;
+
+	if (!prefetch)
+		return;
+
+	pthread_mutex_lock(&prefetch->lock);
+	prefetch->stop = true;
+	pthread_mutex_unlock(&prefetch->lock);
+
+	for (i = 0; i < prefetch->nb_thds; i++)
+		pthread_join(prefetch->thds[i], NULL);
+
+	pthread_cond_destroy(&prefetch->cond);
+	pthread_mutex_destroy(&prefetch->lock);
+	free(prefetch);
+}
+
+static int upload_local(const struct flash_params *params,
+			const char *path, const char *tcp_addr)
+{
+	struct local_conn conn;
+	struct transport t = { .local = &conn };
+	const char *name = path ? path : tcp_addr;
+	struct local_addr addr;
+	struct timespec start;
+	unsigned int attempt, done = 0;
+	size_t bytes = 0;
+	double secs;
+	int ret;
+
+	if (path)
+		ret = local_addr_unix(&addr, path);
+	else
+		ret = local_addr_tcp(&addr, tcp_addr, false);
+	if (!ret)
+		ret = local_connect(&conn, &addr);
+	if (ret) {
+		fprintf(stderr, "Unable to connect to %s: %s\n",
+			name, strerror(-ret));
+		return ret;
+	}
+
+	setup_features(&t, path ? "local" : "tcp");
+
+	ret = setup_xfer_params(&t, params, path ? "local" : "tcp");
+	if (ret)
+		goto out_disconnect;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (attempt = 0; ; attempt++) {
+		ret = upload_stage2(&t, params, &done, &bytes);
+		if (!ret || attempt == MAX_RESUMES || !link_lost(&t, ret))
+			break;
+
+		fprintf(stderr, "Lost the connection to %s, reconnecting\n", name);
+
+		local_disconnect(&conn);
+
+		ret = local_connect(&conn, &addr);
+		if (ret) {
+			fprintf(stderr, "Unable to reconnect to %s: %s\n",
+				name, strerror(-ret));
+			return ret;
+		}
+
+		ret = abort_transfers(&t);
+		if (!ret)
+			ret = restore_xfer_params(&t);
+		if (ret)
+			break;
+	}
+
+	if (!ret)
+		ret = cmd_control_iface(&t, CMD_EXIT, 0);
+
+	if (!ret) {
+		secs = elapsed_sec(&start);
+		printf("Uploaded %lu bytes in %.2fs (%.2f MB/s)\n",
+		       (unsigned long)bytes, secs,
+		       secs > 0.0 ? bytes / secs / 1e6 : 0.0);
+	}
+
+out_disconnect:
+	local_disconnect(&conn);
+
+	return ret;
+}
+
+static void usage(void)
+{
+	if (HAS_BUILTIN_INSTALLER)
+		printf("Usage:\n\todboot-client [options] od-update.opk\n");
+	else
+		printf("Usage:\n\todboot-client [options] od-update.opk vmlinuz.bin\n");
+
+	printf("\nOptions:\n"
+	       "\t-q <depth>\tNumber of USB transfers kept in flight (1-%u, default %u)\n"
+	       "\t-c <KiB>\tSize of each USB transfer in KiB (default %u)\n"
+	       "\t-d\t\tOnly send the blocks that differ from the files on the device\n"
+	       "\t-a\t\tFlash all the connected devices at once\n"
+	       "\t-C <dir>\tDirectory of the extracted files cache\n"
+	       "\t-M <MiB>\tMaximum size of the cache (default %llu)\n"
+	       "\t-N\t\tDo not use the cache\n"
+	       "\t-p\t\tExtract the files into the cache while the device boots\n"
+	       "\t-L <socket>\tUpload the stage-2 files to a local odbootd\n"
+	       "\t-t <host>\tUpload the stage-2 files to odbootd over TCP\n"
+	       "\t\t\t(host[:port], default port %s)\n"
+	       "\t-T <file>\tWrite a timing trace of the flash (Chrome trace format)\n"
+	       "\t-K\t\tCalibrate the transfer parameters, and save them as the\n"
+	       "\t\t\tprofile of the board group and link speed\n"
+	       "\t-P <file>\tFile of the calibrated profiles, used unless -q or -c\n"
+	       "\t\t\tis given (default ~/.config/odboot/profiles)\n"
+	       "\t-z\t\tCompress the stage-2 files on any link, not only full speed\n",
+	       MAX_QUEUE_DEPTH, DEFAULT_QUEUE_DEPTH, DEFAULT_CHUNK_SIZE / 1024,
+	       DEFAULT_CACHE_SIZE / (1024 * 1024), LOCAL_TCP_PORT);
+}
+
+int main(int argc, char **argv)
+{
+	struct flash_params params = { 0 };
+	uint64_t cache_size = DEFAULT_CACHE_SIZE;
+	const char *cache_dir = NULL;
+	const char *local_path = NULL, *tcp_addr = NULL;
+	const char *trace_path = NULL;
+	bool prefetch = false;
+	struct session *sessions = NULL;
+	struct OPK *opk;
+	unsigned int i, nb_sessions, nb_failed = 0;
+	const char *fn, *firstdot, *lastdot;
+	char *boardname = NULL, buf[256];
+	unsigned int group, board;
+	struct artifact kernel = { 0 };
+	int ret;
+
+	// windows bundled libc with mingw does caching of buffers
+	// this call disable caching
+#ifdef _WIN32
+	setbuf(stdout, NULL);
+#endif
+
+	while ((ret = getopt(argc, argv, "q:c:daC:M:NpL:t:T:KP:z")) != -1) {
+		switch (ret) {
+		case 'q':
+			queue_depth = strtoul(optarg, NULL, 0);
+			if (queue_depth < 1 || queue_depth > MAX_QUEUE_DEPTH) {
+				usage();
+				return EXIT_FAILURE;
+			}
+			user_xfer_params = true;
+			break;
+		case 'c':
+			chunk_size = strtoul(optarg, NULL, 0) * 1024;
+			if (!chunk_size || chunk_size > 64 * 1024 * 1024) {
+				usage();
+				return EXIT_FAILURE;
+			}
+			user_xfer_params = true;
+			break;
+		case 'd':
+			delta_updates = true;
+			break;
+		case 'a':
+			all_devices = true;
+			break;
+		case 'C':
+			cache_dir = optarg;
+			break;
+		case 'M':
+			cache_size = strtoull(optarg, NULL, 0) * 1024 * 1024;
+			break;
+		case 'N':
+			use_cache = false;
+			break;
+		case 'p':
+			prefetch = true;
+			break;
+		case 'L':
+			local_path = optarg;
+			break;
+		case 't':
+			tcp_addr = optarg;
+			break;
+		case 'T':
+			trace_path = optarg;
+			break;
+		case 'K':
+			calibrate_xfer = true;
+			break;
+		case 'P':
+			snprintf(profile_path, sizeof(profile_path), "%s", optarg);
+			break;
+		case 'z':
+			force_compression = true;
+			break;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!profile_path[0])
+		profile_default_path(profile_path, sizeof(profile_path));
+
+	if (trace_path) {
+		ret = trace_open(trace_path);
+		if (ret) {
+			fprintf(stderr, "Unable to start tracing: %s\n",
+				strerror(-ret));
+			return EXIT_FAILURE;
+		}
+
+		trace_thread_name("main");
+	}
+
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if (argc != (HAS_BUILTIN_INSTALLER ? 2 : 3)) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	opk_filename = argv[1];
+
+	opk = opk_open(opk_filename);
+	if (!opk) {
+		fprintf(stderr, "Unable to open OPK file\n");
+		return EXIT_FAILURE;
+	}
+
+	if (use_cache) {
+		ret = cache_open(&cache, cache_dir, cache_size, opk_filename);
+		if (ret) {
+			fprintf(stderr, "Cache disabled: %s\n", strerror(-ret));
+			use_cache = false;
+		}
+	}
+
+	ret = opk_open_metadata(opk, &fn);
+	if (ret <= 0)
+		goto err_close_opk;
+
+	firstdot = strchr(fn, '.');
+	if (!firstdot)
+		goto err_close_opk;
+
+	lastdot = strchr(firstdot + 1, '.');
+	if (!lastdot)
+		goto err_close_opk;
+
+	boardname = strndup(firstdot + 1, lastdot - firstdot - 1);
+
+	ret = get_device(boardname, &group, &board);
+	if (ret < 0)
+		goto err_free_boardname;
+
+	params.opk = opk;
+	params.boardname = boardname;
+	params.group = &groups[group];
+	params.board = &groups[group].boards[board];
+
+	if (prefetch && !use_cache) {
+		printf("Prefetching needs the cache, streaming the files instead\n");
+	} else if (prefetch) {
+		ret = prefetch_start(&params);
+		if (ret) {
+			fprintf(stderr, "Unable to start prefetching: %s\n",
+				strerror(-ret));
+			goto err_free_params;
+		}
+	}
+
+	snprintf(buf, sizeof(buf), "%s/ubiboot-stage1-%s.bin", boardname,
+		 params.board->btl_code);
+
+	ret = extract_file(opk, &opk_lock, buf, &params.stage1);
+	if (ret < 0) {
+		fprintf(stderr, "Unable to extract stage1 bootloader\n");
+		goto err_free_params;
+	}
+
+	snprintf(buf, sizeof(buf), "%s/%s.dtb", boardname,
+		 params.board->dts_code);
+
+	ret = extract_file(opk, &opk_lock, buf, &params.dtb);
+	if (ret < 0) {
+		fprintf(stderr, "Unable to extract DTB\n");
+		goto err_free_params;
+	}
+
+	if (HAS_BUILTIN_INSTALLER) {
+		params.kernel = (const unsigned char *)&__start_image;
+		params.kernel_size = (uintptr_t)&__end_image - (uintptr_t)&__start_image;
+	} else {
+		ret = load_file(argv[2], &kernel);
+		if (ret) {
+			fprintf(stderr, "Unable to read kernel: %s\n",
+				strerror(-ret));
+			goto err_free_params;
+		}
+
+		params.kernel = kernel.data;
+		params.kernel_size = kernel.size;
+	}
+
+	/* Only the stage-2 upload can run against a local or remote odbootd */
+	if (local_path || tcp_addr) {
+		ret = upload_local(&params, local_path, tcp_addr);
+		goto err_free_params;
+	}
+
+	ret = libusb_init(&usb_ctx);
+	if (ret) {
+		fprintf(stderr, "Unable to init libusb\n");
+		goto err_free_params;
+	}
+
+	printf("trying to init device 0x%04x 0x%04x\n",
+	       params.group->vid, params.group->pid);
+
+	ret = find_devices(&params, all_devices, &sessions);
+	if (ret <= 0) {
+		fprintf(stderr, "Unable to find Ingenic device.\n");
+		ret = ret ? ret : -ENOENT;
+		goto out_exit_libusb;
+	}
+
+	nb_sessions = ret;
+
+	if (nb_sessions == 1) {
+		session_thread(&sessions[0]);
+	} else {
+		printf("Flashing %u devices\n", nb_sessions);
+
+		for (i = 0; i < nb_sessions; i++) {
+			ret = pthread_create(&sessions[i].thd, NULL,
+					     session_thread, &sessions[i]);
+			if (ret) {
+				sessions[i].ret = -ret;
+				sessions[i].step = "not started";
+			}
+		}
+
+		for (i = 0; i < nb_sessions; i++) {
+			if (strcmp(sessions[i].step, "not started"))
+				pthread_join(sessions[i].thd, NULL);
+		}
+	}
+
+	for (i = 0; i < nb_sessions; i++) {
+		if (sessions[i].ret)
+			nb_failed++;
+		libusb_unref_device(sessions[i].dev);
+	}
+
+	if (all_devices)
+		print_sessions(sessions, nb_sessions);
+
+	ret = nb_failed ? -EIO : 0;
+
+	free(sessions);
 out_exit_libusb:
 	libusb_exit(usb_ctx);
+err_free_params:
+	prefetch_stop(&params);
+	release_file(&kernel);
+	release_file(&params.dtb);
+	release_file(&params.stage1);
 err_free_boardname:
 	free(boardname);
 err_close_opk:
 	opk_close(opk);
+	trace_close();
 
-	return EXIT_SUCCESS;
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
 }
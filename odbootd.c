@@ -6,10 +6,14 @@
  * Licensed under the GPLv2
  */
 
+#define _GNU_SOURCE
+
 #include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/aio_abi.h>
 #include <linux/usb/functionfs.h>
+#include <mtd/ubi-user.h>
 #include <poll.h>
 #include <pthread.h>
 #include <signal.h>
@@ -19,17 +23,205 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "crc32c.h"
+#include "local.h"
+#include "lz4.h"
+#include "xxhash.h"
+
 #define NAME u8"JZBOOT"
 
 #define LE32(x) ((__BYTE_ORDER != __BIG_ENDIAN) ? (x) : __builtin_bswap32(x))
 #define LE16(x) ((__BYTE_ORDER != __BIG_ENDIAN) ? (x) : __builtin_bswap16(x))
 
+#define DEFAULT_RX_DEPTH	8
+#define MAX_RX_DEPTH		64
+#define DEFAULT_RX_BUF_SIZE	(64 * 1024)
+#define MAX_RX_BUF_SIZE		(1024 * 1024)
+#define MAX_RX_QUEUE_SIZE	(4 * 1024 * 1024) /* rx_buf_size x rx_depth */
+
+#define DEFAULT_STREAMS		2
+#define MAX_STREAMS		4
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define MANIFEST_BLOCK_SIZE	(64 * 1024)
+
+/* Written by the client to measure uploads, and deleted once received */
+#define FILE_ID_SCRATCH		6
+
+#define DIRECT_BUF_SIZE		(1024 * 1024)
+#define DIRECT_ALIGN		4096
+#define MAX_ERASE_SIZE		(8 * 1024 * 1024)
+
+#define PROGRESS_INTERVAL_MS	500
+#define STALL_THRESHOLD_MS	100
+#define ABORT_RETRY_MS		10
+
+#define MAX_EP0_EVENTS		4 /* As many as FunctionFS queues */
+
+#define UNPACK_DEPTH		4
+#define UNPACK_BUF_SIZE		(1024 * 1024)
+#define UNPACK_MEM_SIZE		(2 * 1024 * 1024) /* Queued, all streams */
+
 enum jzboot_commands {
 	CMD_EXIT,
 	CMD_OPEN_FILE,
 	CMD_CLOSE_FILE,
+	CMD_GET_MANIFEST,
+	CMD_GET_DIGEST,
+	CMD_GET_STATS,
+	CMD_SET_PARAM,
+	CMD_GET_FEATURES,
+	CMD_GET_RESUME,
+	CMD_OPEN_BATCH,
+	CMD_ABORT,
+};
+
+/* Reply to CMD_GET_FEATURES: what the client may use, as a 32-bit mask */
+enum jzboot_features {
+	FEATURE_LZ4		= 1 << 0, /* OPEN_FLAG_LZ4 and EXTENT_LZ4 */
+	FEATURE_BATCH		= 1 << 1, /* CMD_OPEN_BATCH */
+	FEATURE_SCRATCH		= 1 << 2, /* FILE_ID_SCRATCH */
+	FEATURE_ABORT		= 1 << 3, /* CMD_ABORT */
+};
+
+/*
+ * CMD_OPEN_FILE, CMD_OPEN_BATCH and CMD_CLOSE_FILE pass the index of the
+ * stream (and of its bulk OUT endpoint, minus one) in bits 12-15 of wValue.
+ * The open flags are passed in bits 8-11, and the file id in the low byte.
+ */
+#define WVALUE_FILE_ID(x)	((x) & 0xff)
+#define WVALUE_OPEN_FLAGS(x)	(((x) >> 8) & 0xf)
+#define WVALUE_STREAM(x)	((x) >> 12)
+
+/*
+ * CMD_SET_PARAM passes the parameter in bits 12-15 of wValue, and its
+ * value in the low 12 bits. It applies to all the streams, and can only
+ * be sent while no file is open.
+ */
+#define WVALUE_PARAM(x)		((x) >> 12)
+#define WVALUE_PARAM_VALUE(x)	((x) & 0xfff)
+
+enum jzboot_params {
+	PARAM_RX_BUF_SIZE,	/* Size of each read from the endpoints, in KiB */
+	PARAM_RX_DEPTH,		/* Number of AIO reads queued per endpoint */
+};
+
+enum jzboot_open_flags {
+	OPEN_FLAG_EXTENTS	= 1 << 0, /* Data is sent as a list of extents */
+	OPEN_FLAG_KEEP		= 1 << 1, /* Do not truncate the existing file */
+	OPEN_FLAG_LZ4		= 1 << 2, /* Extents may be compressed */
+	OPEN_FLAG_RESUME	= 1 << 3, /* Continue an interrupted transfer */
+};
+
+/*
+ * With OPEN_FLAG_EXTENTS, the file size is followed by extent headers,
+ * each one followed by 'length' bytes of data to write at 'offset'.
+ * Zero extents have no data, and are written as holes when possible.
+ * An extent with a length of zero terminates the list.
+ *
+ * With OPEN_FLAG_LZ4, the data of an extent flagged EXTENT_LZ4 is an LZ4
+ * block, preceded by its 32-bit size. The extents of such files are at
+ * most UNPACK_BUF_SIZE bytes, compressed or not.
+ */
+enum jzboot_extent_flags {
+	EXTENT_ZERO		= 1 << 0,
+	EXTENT_LZ4		= 1 << 1,
+};
+
+struct jzboot_extent {
+	uint32_t offset;
+	uint32_t length;
+	uint32_t flags;
+} __attribute__((packed));
+
+/*
+ * After CMD_OPEN_BATCH, the files are sent back to back on the stream's
+ * endpoint, each one as an entry followed by what CMD_OPEN_FILE would
+ * expect after the file size. An entry with the id BATCH_END terminates
+ * the batch, which is then closed with CMD_CLOSE_FILE. A file that fails
+ * ends the batch; the digest of each file tells which ones were written.
+ */
+#define BATCH_END		0xffffffff
+
+struct jzboot_batch_entry {
+	uint32_t file_id;
+	uint32_t flags;		/* enum jzboot_open_flags */
+	uint32_t size;
+} __attribute__((packed));
+
+/* Reply to CMD_GET_MANIFEST, followed by one 64-bit XXH64 per block */
+struct jzboot_manifest {
+	uint32_t file_size;
+	uint32_t block_size;
+	uint32_t nb_blocks;
+	uint32_t first_block;
+} __attribute__((packed));
+
+/*
+ * Reply to CMD_GET_DIGEST: CRC32C of the last file written with the id
+ * passed in wValue, computed while its data was being received.
+ */
+enum jzboot_digest_flags {
+	DIGEST_VALID		= 1 << 0,
+};
+
+struct jzboot_digest {
+	uint32_t size;
+	uint32_t crc32c;
+	uint32_t flags;
+} __attribute__((packed));
+
+/*
+ * Reply to CMD_GET_RESUME: how much of the file with the id passed in
+ * wValue was written before its transfer was interrupted. If its own data
+ * has the same CRC32C up to 'offset', the client can open the file again
+ * with OPEN_FLAG_RESUME and OPEN_FLAG_EXTENTS, and only send the extents
+ * past 'offset'. A file size of zero means there is nothing to resume.
+ */
+struct jzboot_resume {
+	uint32_t file_size;
+	uint32_t offset;
+	uint32_t crc32c;
+} __attribute__((packed));
+
+/*
+ * Reply to CMD_GET_STATS: one entry per stream, about the file being
+ * received, or the last one. A chunk is one read from the endpoint; its
+ * latency includes the time spent waiting for the host.
+ */
+enum jzboot_stats_flags {
+	STATS_ACTIVE		= 1 << 0, /* A file is being received */
+};
+
+struct jzboot_stats {
+	uint32_t flags;
+	uint32_t file_id;
+	uint32_t file_size;
+	uint32_t elapsed_ms;	/* Since the file was opened */
+	uint64_t bytes;		/* Received for the file */
+	uint64_t total_bytes;	/* Received since the client connected */
+	uint32_t nb_chunks;
+	uint32_t max_chunk_us;
+	uint64_t chunk_us;	/* Sum of the latencies of all the chunks */
+	uint32_t nb_stalls;	/* Chunks slower than STALL_THRESHOLD_MS */
+} __attribute__((packed));
+
+/* How the control endpoint is reached: FunctionFS, or a local socket */
+struct jzboot_transport {
+	int (*read_events)(int fd, struct usb_functionfs_event *events,
+			   unsigned int max); /* Returns the number read */
+	int (*reply)(int fd, const void *buf, size_t len);
+	void (*status)(int fd, int ret, bool replied);
+	bool aio; /* Whether AIO reads of the endpoints can be queued */
 };
 
 struct usb_ffs_header {
@@ -43,11 +235,151 @@ struct usb_ffs_strings {
 	const char string[sizeof(NAME)];
 } __attribute__((packed));
 
+enum jzboot_rx_mode {
+	RX_MODE_COPY,
+	RX_MODE_AIO,
+	RX_MODE_SPLICE,
+};
+
+/* Lifecycle of the gadget, as told by the FunctionFS events */
+enum jzboot_state {
+	STATE_UNBOUND,
+	STATE_BOUND,		/* Bound to the UDC, not configured by the host */
+	STATE_ENABLED,
+	STATE_SUSPENDED,
+};
+
+/* What a file is written to, set with -T for raw partitions and volumes */
+enum jzboot_target {
+	TARGET_FILE,
+	TARGET_BLOCK,	/* Written in erase blocks through the write engine */
+	TARGET_UBI,	/* Written sequentially, in a UBI_IOCVOLUP update */
+};
+
+enum jzboot_job {
+	JOB_NONE,
+	JOB_FILE,	/* CMD_OPEN_FILE */
+	JOB_BATCH,	/* CMD_OPEN_BATCH */
+	JOB_EXIT,
+};
+
+struct aio_request {
+	struct iocb iocb;
+	char *buf;
+	long res;
+	bool done;
+};
+
+/* One per stream, each with its own bulk OUT endpoint and worker thread */
 struct pdata {
-	pthread_t thd;
+	unsigned int index;
 	int data_fd;
-	int ep1_fd;
+	int ep0_fd;
+	int ep_fd;
 	const char *fn;
+	char path[256];
+	unsigned int file_id, open_flags;
+	enum jzboot_target target;
+
+	/* CRC32C of the file's content from offset 0 to 'digest_offset' */
+	uint32_t digest, digest_offset;
+	bool digest_valid;
+
+	/* Size of the interrupted transfer continued with OPEN_FLAG_RESUME */
+	uint32_t resume_size;
+
+	enum jzboot_rx_mode rx_mode;
+	unsigned int rx_depth, rx_buf_size;
+
+	aio_context_t aio_ctx;
+	int aio_fd;
+	int pipe_fds[2];
+	struct aio_request reqs[MAX_RX_DEPTH];
+
+	/*
+	 * Direct I/O write engine: data is coalesced into 'wbuf', and written
+	 * through 'direct_fd' in aligned chunks. The unaligned head and tail
+	 * go through the page cache with 'data_fd'. Block devices always use
+	 * it, aligned to their erase blocks; 'wbuf' holds at least one.
+	 */
+	bool direct;
+	int direct_fd;
+	size_t align;
+	char *wbuf;
+	size_t wbuf_size;
+	off_t wbuf_start;
+	size_t wbuf_len;
+
+	/*
+	 * Worker thread, started with the first job. 'busy' is only used by
+	 * the ep0 thread, and stays set until the end of the job is reaped.
+	 */
+	pthread_t thd;
+	bool worker, busy, close_pending;
+	pthread_mutex_t job_lock;
+	pthread_cond_t job_cond;
+	enum jzboot_job job;
+	bool job_done;
+	int job_status;
+
+	/* Progress, kept in host order and read by CMD_GET_STATS */
+	pthread_mutex_t stats_lock;
+	struct jzboot_stats stats;
+	bool resumed; /* The next chunk waited for the bus to resume */
+	struct timespec opened, last_chunk, last_print;
+};
+
+/* An extent of a compressed file, read from the endpoint but not written */
+struct jzboot_unpack_slot {
+	uint32_t offset, length, flags;
+	uint32_t packed_len;
+	char *buf; /* NULL for zero extents */
+};
+
+/*
+ * Queue of extents between the thread reading a compressed file from the
+ * endpoint and the thread writing it, so that neither waits for the other.
+ */
+struct jzboot_unpack {
+	struct pdata *pdata;
+	pthread_t thd;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct jzboot_unpack_slot slots[UNPACK_DEPTH];
+	unsigned int head, count;
+	bool done;
+	int status;
+
+	/* Decompressed data of the extent being written */
+	char *out;
+};
+
+/*
+ * Memory held by the slots of all the streams. Each slot is allocated for
+ * the extent it holds, and freed once written, so that small targets don't
+ * keep UNPACK_DEPTH buffers of UNPACK_BUF_SIZE bytes around per stream.
+ */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	size_t used;
+} unpack_mem = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* A CMD_GET_MANIFEST page being hashed, replied to once 'done' is set */
+struct jzboot_manifest_job {
+	pthread_t thd;
+	bool pending;
+	unsigned int id, page;
+	uint16_t length;
+
+	pthread_mutex_t lock;
+	bool done;
+	int status;
+	struct jzboot_manifest *manifest;
+	size_t len;
 };
 
 static const struct usb_ffs_strings ffs_strings = {
@@ -64,114 +396,2232 @@ static const struct usb_ffs_strings ffs_strings = {
 
 static int stop_fd;
 
-static inline int poll_nointr(struct pollfd *pfd, unsigned int num_pfd)
+/* Written by the workers and the manifest thread when a job is over */
+static int done_fd;
+
+static struct jzboot_manifest_job manifest_job = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Set by SIGUSR1 in a worker whose transfer is being aborted */
+static __thread volatile sig_atomic_t jzboot_aborted;
+
+static inline int poll_nointr(struct pollfd *pfd, unsigned int num_pfd)
+{
+	int ret;
+
+	do {
+		ret = poll(pfd, num_pfd, -1);
+	} while (ret == -1 && errno == EINTR && !jzboot_aborted);
+
+	return ret;
+}
+
+static const char * const jzboot_file_paths[] = {
+	"/boot/rootfs.squashfs",
+	"/boot/uzImage.bin",
+	"/boot/devicetree.dtb",
+	"/boot/ubiboot.bin",
+	"/boot/mininit-syspart",
+	"/boot/modules.squashfs",
+	[FILE_ID_SCRATCH] = "/boot/.odbootd-scratch",
+};
+
+static struct jzboot_digest jzboot_digests[ARRAY_SIZE(jzboot_file_paths)];
+static struct jzboot_resume jzboot_resumes[ARRAY_SIZE(jzboot_file_paths)];
+
+/* Prepended to the paths above, to write the files somewhere else */
+static const char *root_dir = "";
+
+/* Devices written in place of the files above, set with -T */
+static const char *jzboot_targets[ARRAY_SIZE(jzboot_file_paths)];
+
+static const struct jzboot_transport *transport;
+static bool ep0_replied, ep0_in;
+static enum jzboot_state gadget_state;
+
+static inline int io_setup(unsigned int nr, aio_context_t *ctx)
+{
+	return syscall(__NR_io_setup, nr, ctx);
+}
+
+static inline int io_destroy(aio_context_t ctx)
+{
+	return syscall(__NR_io_destroy, ctx);
+}
+
+static inline int io_submit(aio_context_t ctx, long nr, struct iocb **iocbpp)
+{
+	return syscall(__NR_io_submit, ctx, nr, iocbpp);
+}
+
+static inline int io_cancel(aio_context_t ctx, struct iocb *iocb,
+			    struct io_event *result)
+{
+	return syscall(__NR_io_cancel, ctx, iocb, result);
+}
+
+static inline int io_getevents(aio_context_t ctx, long min_nr, long nr,
+			       struct io_event *events,
+			       struct timespec *timeout)
+{
+	return syscall(__NR_io_getevents, ctx, min_nr, nr, events, timeout);
+}
+
+static uint64_t elapsed_us(const struct timespec *start,
+			   const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000ll +
+		(end->tv_nsec - start->tv_nsec) / 1000;
+}
+
+static void jzboot_stats_open(struct pdata *pdata, unsigned int id)
+{
+	struct jzboot_stats *stats = &pdata->stats;
+
+	clock_gettime(CLOCK_MONOTONIC, &pdata->opened);
+	pdata->last_chunk = pdata->opened;
+	pdata->last_print = pdata->opened;
+
+	pthread_mutex_lock(&pdata->stats_lock);
+	stats->flags = STATS_ACTIVE;
+	stats->file_id = id;
+	stats->file_size = 0;
+	stats->elapsed_ms = 0;
+	stats->bytes = 0;
+	stats->nb_chunks = 0;
+	stats->max_chunk_us = 0;
+	stats->chunk_us = 0;
+	stats->nb_stalls = 0;
+	pthread_mutex_unlock(&pdata->stats_lock);
+}
+
+static void jzboot_print_progress(const struct pdata *pdata,
+				  const struct timespec *now, bool done)
+{
+	const struct jzboot_stats *stats = &pdata->stats;
+	uint64_t us = elapsed_us(&pdata->opened, now);
+
+	printf("\r%s: %llu of %u bytes (%.2f MB/s)", pdata->fn,
+	       (unsigned long long)stats->bytes, stats->file_size,
+	       us ? (double)stats->bytes / us : 0.0);
+
+	if (done)
+		printf(", %u stalls, slowest chunk %u ms\n",
+		       stats->nb_stalls, stats->max_chunk_us / 1000);
+
+	fflush(stdout);
+}
+
+/*
+ * Account for 'bytes' more bytes received. Writing to the console is slow
+ * (especially a serial one), so the progress is only printed every
+ * PROGRESS_INTERVAL_MS.
+ */
+static void jzboot_progress(struct pdata *pdata, uint32_t bytes)
+{
+	struct jzboot_stats *stats = &pdata->stats;
+	struct timespec now;
+	uint64_t chunk_us;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	chunk_us = elapsed_us(&pdata->last_chunk, &now);
+	pdata->last_chunk = now;
+
+	pthread_mutex_lock(&pdata->stats_lock);
+	stats->bytes += bytes;
+	stats->total_bytes += bytes;
+	stats->nb_chunks++;
+	stats->chunk_us += chunk_us;
+
+	/* A suspended bus is the host's choice, not a stall */
+	if (!pdata->resumed) {
+		if (chunk_us > stats->max_chunk_us)
+			stats->max_chunk_us = chunk_us;
+		if (chunk_us >= STALL_THRESHOLD_MS * 1000)
+			stats->nb_stalls++;
+	}
+	pdata->resumed = false;
+	pthread_mutex_unlock(&pdata->stats_lock);
+
+	if (elapsed_us(&pdata->last_print, &now) >= PROGRESS_INTERVAL_MS * 1000) {
+		pdata->last_print = now;
+		jzboot_print_progress(pdata, &now, false);
+	}
+}
+
+static void jzboot_progress_done(struct pdata *pdata)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&pdata->stats_lock);
+	pdata->stats.flags &= ~STATS_ACTIVE;
+	pdata->stats.elapsed_ms = elapsed_us(&pdata->opened, &now) / 1000;
+	pthread_mutex_unlock(&pdata->stats_lock);
+
+	jzboot_print_progress(pdata, &now, true);
+}
+
+static void jzboot_file_path(unsigned int id, char *buf, size_t len)
+{
+	if (jzboot_targets[id])
+		snprintf(buf, len, "%s", jzboot_targets[id]);
+	else
+		snprintf(buf, len, "%s%s", root_dir, jzboot_file_paths[id]);
+}
+
+/* Parse <name>=<device>, the name being that of the file without suffix */
+static int jzboot_set_target(const char *arg)
+{
+	const char *dev = strchr(arg, '='), *name;
+	unsigned int id;
+
+	if (!dev || !dev[1])
+		return -EINVAL;
+
+	for (id = 0; id < FILE_ID_SCRATCH; id++) {
+		name = strrchr(jzboot_file_paths[id], '/') + 1;
+
+		if (!strncmp(name, arg, dev - arg) &&
+		    (name[dev - arg] == '.' || !name[dev - arg])) {
+			jzboot_targets[id] = dev + 1;
+			return 0;
+		}
+	}
+
+	return -ENOENT;
+}
+
+/* The endpoint of the local transport may return short reads */
+static int jzboot_read_all(int fd, void *buf, size_t len)
+{
+	char *ptr = buf;
+	ssize_t ret;
+
+	while (len) {
+		if (jzboot_aborted)
+			return -EINTR;
+
+		ret = read(fd, ptr, len);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		if (!ret)
+			return -EIO;
+
+		ptr += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int jzboot_write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, buf, len);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int jzboot_pwrite_all(int fd, const char *buf, size_t len, off_t offset)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(fd, buf, len, offset);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		buf += ret;
+		len -= ret;
+		offset += ret;
+	}
+
+	return 0;
+}
+
+static int jzboot_direct_open(struct pdata *pdata)
+{
+	pdata->direct_fd = open(pdata->fn, O_WRONLY | O_DIRECT);
+	if (pdata->direct_fd == -1)
+		return -errno;
+
+	pdata->wbuf_start = 0;
+	pdata->wbuf_len = 0;
+
+	return 0;
+}
+
+static void jzboot_direct_close(struct pdata *pdata)
+{
+	if (pdata->direct_fd >= 0)
+		close(pdata->direct_fd);
+
+	pdata->direct_fd = -1;
+}
+
+/*
+ * Write out the coalesced data. The page-aligned part goes through O_DIRECT,
+ * so that partial pages written through the page cache never overlap it;
+ * the unaligned tail is kept in the buffer for the next flush, unless
+ * 'all' is set, in which case it is written through the page cache.
+ */
+static int jzboot_direct_flush(struct pdata *pdata, bool all)
+{
+	size_t skew = pdata->wbuf_start & (pdata->align - 1);
+	char *data = pdata->wbuf + skew;
+	size_t len = pdata->wbuf_len, head, body;
+	off_t offset = pdata->wbuf_start;
+	int ret;
+
+	if (skew && len) {
+		head = pdata->align - skew;
+		if (head > len)
+			head = len;
+
+		ret = jzboot_pwrite_all(pdata->data_fd, data, head, offset);
+		if (ret)
+			return ret;
+
+		data += head;
+		offset += head;
+		len -= head;
+	}
+
+	body = len & ~(pdata->align - 1);
+	if (body) {
+		ret = jzboot_pwrite_all(pdata->direct_fd, data, body, offset);
+		if (ret == -EINVAL) {
+			printf("O_DIRECT write failed, falling back to buffered writes\n");
+			jzboot_direct_close(pdata);
+			ret = jzboot_pwrite_all(pdata->data_fd, data, len, offset);
+			body = len;
+		}
+		if (ret)
+			return ret;
+
+		data += body;
+		offset += body;
+		len -= body;
+	}
+
+	if (all && len) {
+		ret = jzboot_pwrite_all(pdata->data_fd, data, len, offset);
+		if (ret)
+			return ret;
+
+		offset += len;
+		len = 0;
+	}
+
+	memmove(pdata->wbuf, data, len);
+	pdata->wbuf_start = offset;
+	pdata->wbuf_len = len;
+
+	/* After a fallback, writes continue from the file position */
+	if (pdata->direct_fd < 0 && lseek(pdata->data_fd, offset, SEEK_SET) == -1)
+		return -errno;
+
+	return 0;
+}
+
+/* Write received data at the current position of the file */
+static int jzboot_store(struct pdata *pdata, const char *buf, size_t len)
+{
+	size_t skew, room;
+	int ret;
+
+	if (pdata->direct_fd < 0)
+		return jzboot_write_all(pdata->data_fd, buf, len);
+
+	while (len) {
+		skew = pdata->wbuf_start & (pdata->align - 1);
+		room = pdata->wbuf_size - skew - pdata->wbuf_len;
+		if (room > len)
+			room = len;
+
+		memcpy(pdata->wbuf + skew + pdata->wbuf_len, buf, room);
+		pdata->wbuf_len += room;
+		buf += room;
+		len -= room;
+
+		if (skew + pdata->wbuf_len == pdata->wbuf_size) {
+			ret = jzboot_direct_flush(pdata, false);
+			if (ret)
+				return ret;
+
+			/* O_DIRECT writes failed, continue with the page cache */
+			if (pdata->direct_fd < 0)
+				return jzboot_write_all(pdata->data_fd, buf, len);
+		}
+	}
+
+	return 0;
+}
+
+static int jzboot_store_seek(struct pdata *pdata, off_t offset)
+{
+	int ret;
+
+	/* A volume update cannot seek, the extents must follow each other */
+	if (pdata->target == TARGET_UBI)
+		return offset == pdata->digest_offset ? 0 : -EINVAL;
+
+	if (pdata->direct_fd >= 0) {
+		ret = jzboot_direct_flush(pdata, true);
+		if (ret)
+			return ret;
+
+		pdata->wbuf_start = offset;
+	}
+
+	if (lseek(pdata->data_fd, offset, SEEK_SET) == -1)
+		return -errno;
+
+	return 0;
+}
+
+static int jzboot_store_finish(struct pdata *pdata)
+{
+	if (pdata->direct_fd < 0)
+		return 0;
+
+	return jzboot_direct_flush(pdata, true);
+}
+
+static void jzboot_digest_update(struct pdata *pdata,
+				 const void *buf, size_t len)
+{
+	pdata->digest = crc32c(pdata->digest, buf, len);
+	pdata->digest_offset += len;
+}
+
+static void jzboot_digest_zeros(struct pdata *pdata, uint32_t length)
+{
+	static const char zeros[4096];
+	uint32_t len;
+
+	for (; length; length -= len) {
+		len = length < sizeof(zeros) ? length : sizeof(zeros);
+		jzboot_digest_update(pdata, zeros, len);
+	}
+}
+
+/*
+ * Bring the digest up to 'offset' with what is already in the file: blocks
+ * kept from the previous version, holes, or data that was spliced in.
+ */
+static int jzboot_digest_catch_up(struct pdata *pdata, uint32_t offset)
+{
+	char buf[16384];
+	uint32_t len;
+	ssize_t ret;
+
+	/* Extents must come in order for the digest to be computed inline */
+	if (offset < pdata->digest_offset) {
+		pdata->digest_valid = false;
+		return 0;
+	}
+
+	while (pdata->digest_offset < offset) {
+		len = offset - pdata->digest_offset;
+		if (len > sizeof(buf))
+			len = sizeof(buf);
+
+		ret = pread(pdata->data_fd, buf, len, pdata->digest_offset);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		/* Past the end of the file, until the final ftruncate() */
+		if (!ret) {
+			memset(buf, 0, len);
+			ret = len;
+		}
+
+		jzboot_digest_update(pdata, buf, ret);
+	}
+
+	return 0;
+}
+
+static int jzboot_copy_data(struct pdata *pdata, uint32_t data_size)
+{
+	uint32_t transfer_size;
+	ssize_t ret = 0;
+	char *buf;
+
+	buf = malloc(pdata->rx_buf_size);
+	if (!buf)
+		return -ENOMEM;
+
+	for (transfer_size = data_size; transfer_size; ) {
+		uint32_t bytes_read, to_read = transfer_size;
+
+		if (to_read > pdata->rx_buf_size)
+			to_read = pdata->rx_buf_size;
+
+		ret = read(pdata->ep_fd, buf, to_read);
+		if (ret == -1) {
+			ret = -errno;
+			break;
+		}
+
+		/* The local transport's client went away */
+		if (!ret) {
+			ret = -EPIPE;
+			break;
+		}
+
+		bytes_read = ret;
+
+		ret = jzboot_store(pdata, buf, bytes_read);
+		if (ret)
+			break;
+
+		jzboot_digest_update(pdata, buf, bytes_read);
+
+		transfer_size -= bytes_read;
+
+		jzboot_progress(pdata, bytes_read);
+	}
+
+	free(buf);
+
+	return ret;
+}
+
+static int jzboot_aio_setup(struct pdata *pdata)
+{
+	unsigned int i;
+	int ret;
+
+	pdata->aio_ctx = 0;
+
+	ret = io_setup(pdata->rx_depth, &pdata->aio_ctx);
+	if (ret == -1)
+		return -errno;
+
+	pdata->aio_fd = eventfd(0, EFD_NONBLOCK);
+	if (pdata->aio_fd == -1) {
+		ret = -errno;
+		goto err_destroy;
+	}
+
+	for (i = 0; i < pdata->rx_depth; i++) {
+		ret = posix_memalign((void **)&pdata->reqs[i].buf,
+				     sysconf(_SC_PAGESIZE), pdata->rx_buf_size);
+		if (ret) {
+			ret = -ret;
+			goto err_free_bufs;
+		}
+	}
+
+	return 0;
+
+err_free_bufs:
+	while (i--)
+		free(pdata->reqs[i].buf);
+	close(pdata->aio_fd);
+err_destroy:
+	io_destroy(pdata->aio_ctx);
+	return ret;
+}
+
+static void jzboot_aio_cleanup(struct pdata *pdata)
+{
+	unsigned int i;
+
+	for (i = 0; i < pdata->rx_depth; i++)
+		free(pdata->reqs[i].buf);
+
+	close(pdata->aio_fd);
+	io_destroy(pdata->aio_ctx);
+}
+
+/*
+ * Wait until one of the AIO requests completes, or the daemon is asked
+ * to stop. Completed requests are flagged as done with their result.
+ */
+static int jzboot_aio_wait(struct pdata *pdata)
+{
+	struct io_event events[MAX_RX_DEPTH];
+	struct timespec timeout = { 0, 0 };
+	struct aio_request *req;
+	struct pollfd pfd[2];
+	uint64_t nb;
+	int i, ret;
+
+	pfd[0].fd = pdata->aio_fd;
+	pfd[0].events = POLLIN;
+	pfd[0].revents = 0;
+	pfd[1].fd = stop_fd;
+	pfd[1].events = POLLIN;
+	pfd[1].revents = 0;
+
+	poll_nointr(pfd, 2);
+
+	if ((pfd[1].revents & POLLIN) || jzboot_aborted)
+		return -EINTR;
+
+	if (read(pdata->aio_fd, &nb, sizeof(nb)) == -1 && errno != EAGAIN)
+		return -errno;
+
+	ret = io_getevents(pdata->aio_ctx, 0, pdata->rx_depth, events, &timeout);
+	if (ret == -1)
+		return -errno;
+
+	for (i = 0; i < ret; i++) {
+		req = &pdata->reqs[events[i].data];
+		req->res = events[i].res;
+		req->done = true;
+	}
+
+	return 0;
+}
+
+/* Cancel the requests still in flight, and wait for them to terminate */
+static void jzboot_aio_cancel(struct pdata *pdata, unsigned int head,
+			      unsigned int busy)
+{
+	struct io_event events[MAX_RX_DEPTH];
+	struct timespec timeout = { 1, 0 };
+	unsigned int i, idx;
+
+	for (i = 0; i < busy; i++) {
+		idx = (head + i) % pdata->rx_depth;
+
+		if (!pdata->reqs[idx].done)
+			io_cancel(pdata->aio_ctx, &pdata->reqs[idx].iocb, &events[0]);
+	}
+
+	while (io_getevents(pdata->aio_ctx, 1, pdata->rx_depth,
+			    events, &timeout) > 0);
+}
+
+/*
+ * Keep up to 'rx_depth' reads of 'rx_buf_size' bytes queued on ep1, so
+ * that the UDC always has a request to complete. The buffers are written
+ * to the file in the order the requests were submitted. A short read, on
+ * a short packet, leaves its shortfall to be queued again.
+ */
+static int jzboot_aio_data(struct pdata *pdata, uint32_t data_size)
+{
+	unsigned int head = 0, tail = 0, busy = 0;
+	uint32_t queued = 0, written = 0;
+	struct aio_request *req;
+	struct iocb *iocbp;
+	int ret = 0;
+
+	while (written < data_size) {
+		while (busy < pdata->rx_depth && queued < data_size) {
+			uint32_t to_read = data_size - queued;
+
+			if (to_read > pdata->rx_buf_size)
+				to_read = pdata->rx_buf_size;
+
+			req = &pdata->reqs[tail];
+			memset(&req->iocb, 0, sizeof(req->iocb));
+			req->iocb.aio_data = tail;
+			req->iocb.aio_fildes = pdata->ep_fd;
+			req->iocb.aio_lio_opcode = IOCB_CMD_PREAD;
+			req->iocb.aio_buf = (uintptr_t)req->buf;
+			req->iocb.aio_nbytes = to_read;
+			req->iocb.aio_flags = IOCB_FLAG_RESFD;
+			req->iocb.aio_resfd = pdata->aio_fd;
+			req->done = false;
+
+			iocbp = &req->iocb;
+
+			if (io_submit(pdata->aio_ctx, 1, &iocbp) != 1) {
+				ret = -errno;
+				goto out_cancel;
+			}
+
+			tail = (tail + 1) % pdata->rx_depth;
+			queued += to_read;
+			busy++;
+		}
+
+		req = &pdata->reqs[head];
+
+		while (!req->done) {
+			ret = jzboot_aio_wait(pdata);
+			if (ret)
+				goto out_cancel;
+		}
+
+		if (req->res < 0) {
+			ret = req->res;
+			goto out_cancel;
+		}
+
+		/* The local transport's client went away */
+		if (!req->res) {
+			ret = -EPIPE;
+			goto out_cancel;
+		}
+
+		queued -= req->iocb.aio_nbytes - req->res;
+
+		ret = jzboot_store(pdata, req->buf, req->res);
+		if (ret)
+			goto out_cancel;
+
+		jzboot_digest_update(pdata, req->buf, req->res);
+
+		written += req->res;
+		head = (head + 1) % pdata->rx_depth;
+		busy--;
+
+		jzboot_progress(pdata, req->res);
+	}
+
+	return 0;
+
+out_cancel:
+	jzboot_aio_cancel(pdata, head, busy);
+	return ret;
+}
+
+static int jzboot_splice_setup(struct pdata *pdata)
+{
+	if (pipe(pdata->pipe_fds))
+		return -errno;
+
+	/* Best effort: a larger pipe means larger requests on ep1 */
+	fcntl(pdata->pipe_fds[1], F_SETPIPE_SZ, pdata->rx_buf_size);
+
+	return 0;
+}
+
+static void jzboot_splice_cleanup(struct pdata *pdata)
+{
+	close(pdata->pipe_fds[0]);
+	close(pdata->pipe_fds[1]);
+}
+
+/*
+ * Move the data from ep1 to the file through a pipe, so that it never
+ * gets copied to userspace. Returns -ENOSYS without consuming anything
+ * if ep1 cannot be spliced from.
+ */
+static int jzboot_splice_data(struct pdata *pdata, uint32_t data_size)
+{
+	uint32_t transfer_size;
+	ssize_t ret, in_pipe;
+	int pipe_size;
+
+	pipe_size = fcntl(pdata->pipe_fds[1], F_GETPIPE_SZ);
+	if (pipe_size <= 0)
+		pipe_size = 65536;
+
+	for (transfer_size = data_size; transfer_size; ) {
+		uint32_t to_read = transfer_size;
+
+		if (to_read > (uint32_t)pipe_size)
+			to_read = pipe_size;
+
+		in_pipe = splice(pdata->ep_fd, NULL, pdata->pipe_fds[1], NULL,
+				 to_read, SPLICE_F_MOVE);
+		if (in_pipe == -1) {
+			if (errno == EINTR && !jzboot_aborted)
+				continue;
+			if (errno == EINVAL && transfer_size == data_size)
+				return -ENOSYS;
+			return -errno;
+		}
+
+		if (!in_pipe)
+			return -EIO;
+
+		transfer_size -= in_pipe;
+
+		jzboot_progress(pdata, in_pipe);
+
+		while (in_pipe) {
+			ret = splice(pdata->pipe_fds[0], NULL, pdata->data_fd,
+				     NULL, in_pipe, SPLICE_F_MOVE);
+			if (ret == -1) {
+				if (errno == EINTR)
+					continue;
+				return -errno;
+			}
+
+			in_pipe -= ret;
+		}
+	}
+
+	return 0;
+}
+
+static int jzboot_receive(struct pdata *pdata, uint32_t data_size)
+{
+	off_t pos;
+	int ret = 0;
+
+	/* Devices are written through jzboot_store() */
+	if (pdata->rx_mode == RX_MODE_SPLICE && pdata->target == TARGET_FILE &&
+	    data_size) {
+		ret = jzboot_splice_data(pdata, data_size);
+		if (ret == -ENOSYS) {
+			printf("ep1 does not support splice, falling back to read()\n");
+			jzboot_splice_cleanup(pdata);
+			pdata->rx_mode = RX_MODE_COPY;
+		} else if (!ret) {
+			/* Spliced data is digested back from the page cache */
+			pos = lseek(pdata->data_fd, 0, SEEK_CUR);
+			if (pos == -1)
+				return -errno;
+
+			return jzboot_digest_catch_up(pdata, pos);
+		}
+	}
+
+	if (pdata->rx_mode == RX_MODE_AIO)
+		ret = jzboot_aio_data(pdata, data_size);
+	else
+		ret = jzboot_copy_data(pdata, data_size);
+
+	return ret;
+}
+
+/*
+ * Zero a range of the file. Past the end of the file there is nothing to
+ * do, as the next write or the final ftruncate() will leave a hole there.
+ * Otherwise punch a hole, or write zeros if the filesystem cannot.
+ * Devices get the zeros written at the current position.
+ */
+static int jzboot_zero_range(struct pdata *pdata, uint32_t offset,
+			     uint32_t length)
+{
+	static const char zeros[4096];
+	struct stat st;
+	ssize_t ret;
+	uint32_t len;
+
+	if (pdata->target != TARGET_FILE) {
+		for (; length; length -= len) {
+			len = length < sizeof(zeros) ? length : sizeof(zeros);
+
+			ret = jzboot_store(pdata, zeros, len);
+			if (ret)
+				return ret;
+		}
+
+		return 0;
+	}
+
+	if (fstat(pdata->data_fd, &st))
+		return -errno;
+
+	if (offset >= st.st_size)
+		return 0;
+
+	if (length > st.st_size - offset)
+		length = st.st_size - offset;
+
+	if (!fallocate(pdata->data_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		       offset, length))
+		return 0;
+
+	if (errno != EOPNOTSUPP && errno != ENOSYS)
+		return -errno;
+
+	while (length) {
+		ret = pwrite(pdata->data_fd, zeros,
+			     length < sizeof(zeros) ? length : sizeof(zeros),
+			     offset);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		offset += ret;
+		length -= ret;
+	}
+
+	return 0;
+}
+
+static int jzboot_finish_extents(struct pdata *pdata, uint32_t data_size)
+{
+	int ret;
+
+	ret = jzboot_store_finish(pdata);
+	if (ret)
+		return ret;
+
+	if (pdata->target == TARGET_FILE && ftruncate(pdata->data_fd, data_size))
+		return -errno;
+
+	return jzboot_digest_catch_up(pdata, data_size);
+}
+
+static int jzboot_receive_extents(struct pdata *pdata, uint32_t data_size)
+{
+	struct jzboot_extent extent;
+	uint32_t offset, length, flags;
+	ssize_t ret;
+
+	for (;;) {
+		ret = jzboot_read_all(pdata->ep_fd, &extent, sizeof(extent));
+		if (ret)
+			return ret;
+
+		offset = le32toh(extent.offset);
+		length = le32toh(extent.length);
+		flags = le32toh(extent.flags);
+
+		if (!length)
+			break;
+
+		if (offset > data_size || length > data_size - offset ||
+		    (flags & ~EXTENT_ZERO))
+			return -EINVAL;
+
+		ret = jzboot_store_seek(pdata, offset);
+		if (ret)
+			return ret;
+
+		ret = jzboot_digest_catch_up(pdata, offset);
+		if (ret)
+			return ret;
+
+		if (flags & EXTENT_ZERO) {
+			ret = jzboot_zero_range(pdata, offset, length);
+			if (ret)
+				return ret;
+
+			jzboot_digest_zeros(pdata, length);
+			continue;
+		}
+
+		ret = jzboot_receive(pdata, length);
+		if (ret)
+			return ret;
+	}
+
+	return jzboot_finish_extents(pdata, data_size);
+}
+
+/* Write one extent received in a compressed file */
+static int jzboot_unpack_extent(struct pdata *pdata,
+				const struct jzboot_unpack_slot *slot, char *out)
+{
+	const char *data = slot->buf;
+	ssize_t ret;
+
+	ret = jzboot_store_seek(pdata, slot->offset);
+	if (ret)
+		return ret;
+
+	ret = jzboot_digest_catch_up(pdata, slot->offset);
+	if (ret)
+		return ret;
+
+	if (slot->flags & EXTENT_ZERO) {
+		ret = jzboot_zero_range(pdata, slot->offset, slot->length);
+		if (ret)
+			return ret;
+
+		jzboot_digest_zeros(pdata, slot->length);
+		return 0;
+	}
+
+	if (slot->flags & EXTENT_LZ4) {
+		ret = lz4_decompress(slot->buf, slot->packed_len,
+				     out, slot->length);
+		if (ret < 0)
+			return ret;
+		if (ret != slot->length)
+			return -EINVAL;
+
+		data = out;
+	}
+
+	ret = jzboot_store(pdata, data, slot->length);
+	if (ret)
+		return ret;
+
+	jzboot_digest_update(pdata, data, slot->length);
+
+	return 0;
+}
+
+/*
+ * Wait until the slot's extent fits in UNPACK_MEM_SIZE, and allocate it.
+ * jzboot_abort_file() wakes the wait up, as signals don't.
+ */
+static int jzboot_unpack_alloc(struct jzboot_unpack_slot *slot)
+{
+	pthread_mutex_lock(&unpack_mem.lock);
+
+	while (unpack_mem.used + slot->packed_len > UNPACK_MEM_SIZE &&
+	       !jzboot_aborted)
+		pthread_cond_wait(&unpack_mem.cond, &unpack_mem.lock);
+
+	if (jzboot_aborted) {
+		pthread_mutex_unlock(&unpack_mem.lock);
+		return -EINTR;
+	}
+
+	unpack_mem.used += slot->packed_len;
+
+	pthread_mutex_unlock(&unpack_mem.lock);
+
+	slot->buf = malloc(slot->packed_len);
+	if (!slot->buf) {
+		pthread_mutex_lock(&unpack_mem.lock);
+		unpack_mem.used -= slot->packed_len;
+		pthread_cond_broadcast(&unpack_mem.cond);
+		pthread_mutex_unlock(&unpack_mem.lock);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void jzboot_unpack_free(struct jzboot_unpack_slot *slot)
+{
+	if (!slot->buf)
+		return;
+
+	free(slot->buf);
+	slot->buf = NULL;
+
+	pthread_mutex_lock(&unpack_mem.lock);
+	unpack_mem.used -= slot->packed_len;
+	pthread_cond_broadcast(&unpack_mem.cond);
+	pthread_mutex_unlock(&unpack_mem.lock);
+}
+
+static void * jzboot_unpack_thread(void *d)
+{
+	struct jzboot_unpack *unpack = d;
+	struct jzboot_unpack_slot *slot;
+	unsigned int i;
+	int ret;
+
+	pthread_mutex_lock(&unpack->lock);
+
+	for (;;) {
+		while (!unpack->count && !unpack->done)
+			pthread_cond_wait(&unpack->cond, &unpack->lock);
+
+		if (!unpack->count)
+			break;
+
+		slot = &unpack->slots[unpack->head];
+		pthread_mutex_unlock(&unpack->lock);
+
+		ret = 0;
+		if ((slot->flags & EXTENT_LZ4) && !unpack->out) {
+			unpack->out = malloc(UNPACK_BUF_SIZE);
+			if (!unpack->out)
+				ret = -ENOMEM;
+		}
+
+		if (!ret)
+			ret = jzboot_unpack_extent(unpack->pdata, slot,
+						   unpack->out);
+
+		pthread_mutex_lock(&unpack->lock);
+
+		if (ret) {
+			/* Give the memory back to the other streams now */
+			for (i = 0; i < unpack->count; i++)
+				jzboot_unpack_free(&unpack->slots[(unpack->head + i) %
+								  UNPACK_DEPTH]);
+
+			unpack->status = ret;
+			pthread_cond_broadcast(&unpack->cond);
+			break;
+		}
+
+		jzboot_unpack_free(slot);
+
+		unpack->head = (unpack->head + 1) % UNPACK_DEPTH;
+		unpack->count--;
+		pthread_cond_broadcast(&unpack->cond);
+	}
+
+	pthread_mutex_unlock(&unpack->lock);
+
+	return NULL;
+}
+
+/* Wait for a free slot; returns NULL if the unpack thread failed */
+static struct jzboot_unpack_slot * jzboot_unpack_get(struct jzboot_unpack *unpack)
+{
+	struct jzboot_unpack_slot *slot = NULL;
+
+	pthread_mutex_lock(&unpack->lock);
+
+	while (unpack->count == UNPACK_DEPTH && !unpack->status)
+		pthread_cond_wait(&unpack->cond, &unpack->lock);
+
+	if (!unpack->status)
+		slot = &unpack->slots[(unpack->head + unpack->count) % UNPACK_DEPTH];
+
+	pthread_mutex_unlock(&unpack->lock);
+
+	return slot;
+}
+
+static void jzboot_unpack_put(struct jzboot_unpack *unpack)
+{
+	pthread_mutex_lock(&unpack->lock);
+	unpack->count++;
+	pthread_cond_broadcast(&unpack->cond);
+	pthread_mutex_unlock(&unpack->lock);
+}
+
+/*
+ * Receive the extents of a file opened with OPEN_FLAG_LZ4. This thread
+ * only reads them from the endpoint, while the unpack thread decompresses
+ * and writes the previous ones.
+ */
+static int jzboot_receive_packed(struct pdata *pdata, uint32_t data_size)
+{
+	struct jzboot_unpack unpack = { .pdata = pdata };
+	struct jzboot_unpack_slot *slot;
+	struct jzboot_extent extent;
+	uint32_t offset, length, flags, packed_len;
+	unsigned int i;
+	int ret = 0;
+
+	pthread_mutex_init(&unpack.lock, NULL);
+	pthread_cond_init(&unpack.cond, NULL);
+
+	ret = pthread_create(&unpack.thd, NULL, jzboot_unpack_thread, &unpack);
+	if (ret) {
+		ret = -ret;
+		goto out_free;
+	}
+
+	for (;;) {
+		ret = jzboot_read_all(pdata->ep_fd, &extent, sizeof(extent));
+		if (ret)
+			break;
+
+		offset = le32toh(extent.offset);
+		length = le32toh(extent.length);
+		flags = le32toh(extent.flags);
+
+		if (!length)
+			break;
+
+		if (offset > data_size || length > data_size - offset ||
+		    (flags & ~(EXTENT_ZERO | EXTENT_LZ4)) ||
+		    (!(flags & EXTENT_ZERO) && length > UNPACK_BUF_SIZE)) {
+			ret = -EINVAL;
+			break;
+		}
+
+		packed_len = length;
+
+		if (flags & EXTENT_LZ4) {
+			ret = jzboot_read_all(pdata->ep_fd, &packed_len,
+					      sizeof(packed_len));
+			if (ret)
+				break;
+
+			packed_len = le32toh(packed_len);
+			if (packed_len > UNPACK_BUF_SIZE) {
+				ret = -EINVAL;
+				break;
+			}
+		}
+
+		slot = jzboot_unpack_get(&unpack);
+		if (!slot)
+			break;
+
+		slot->offset = offset;
+		slot->length = length;
+		slot->flags = flags;
+		slot->packed_len = packed_len;
+
+		if (!(flags & EXTENT_ZERO)) {
+			ret = jzboot_unpack_alloc(slot);
+			if (ret)
+				break;
+
+			ret = jzboot_read_all(pdata->ep_fd, slot->buf, packed_len);
+			if (ret)
+				break;
+
+			jzboot_progress(pdata, length);
+		}
+
+		jzboot_unpack_put(&unpack);
+	}
+
+	pthread_mutex_lock(&unpack.lock);
+	unpack.done = true;
+	pthread_cond_broadcast(&unpack.cond);
+	pthread_mutex_unlock(&unpack.lock);
+
+	pthread_join(unpack.thd, NULL);
+
+	if (!ret)
+		ret = unpack.status;
+	if (!ret)
+		ret = jzboot_finish_extents(pdata, data_size);
+
+out_free:
+	for (i = 0; i < UNPACK_DEPTH; i++)
+		jzboot_unpack_free(&unpack.slots[i]);
+	free(unpack.out);
+	pthread_cond_destroy(&unpack.cond);
+	pthread_mutex_destroy(&unpack.lock);
+	return ret;
+}
+
+/* Data stage of IN control requests */
+static int jzboot_ep0_reply(struct pdata *pdata, const void *buf, size_t len)
+{
+	ep0_replied = true;
+
+	return transport->reply(pdata->ep0_fd, buf, len);
+}
+
+/* FunctionFS hands out all the queued events at once, a setup last */
+static int jzboot_ffs_read_events(int fd, struct usb_functionfs_event *events,
+				  unsigned int max)
+{
+	ssize_t ret;
+
+	ret = read(fd, events, max * sizeof(*events));
+	if (ret < (ssize_t)sizeof(*events))
+		return -EAGAIN;
+
+	return ret / sizeof(*events);
+}
+
+static int jzboot_ffs_reply(int fd, const void *buf, size_t len)
+{
+	return write(fd, buf, len) < 0 ? -errno : 0;
+}
+
+static void jzboot_ffs_status(int fd, int ret, bool replied)
+{
+	/* Going the wrong way stalls ep0, which rejects an OUT request */
+	if (ret && !ep0_in) {
+		write(fd, NULL, 0);
+		return;
+	}
+
+	/* Clear out the errors on ep0 when we close endpoints */
+	read(fd, NULL, 0);
+}
+
+static const struct jzboot_transport jzboot_ffs_transport = {
+	.read_events = jzboot_ffs_read_events,
+	.reply = jzboot_ffs_reply,
+	.status = jzboot_ffs_status,
+	.aio = true,
+};
+
+static int jzboot_local_read_events(int fd, struct usb_functionfs_event *events,
+				    unsigned int max)
+{
+	int ret;
+
+	memset(events, 0, sizeof(*events));
+	events->type = FUNCTIONFS_SETUP;
+
+	ret = jzboot_read_all(fd, &events->u.setup, sizeof(events->u.setup));
+
+	return ret ? ret : 1;
+}
+
+static int jzboot_local_reply(int fd, const void *buf, size_t len)
+{
+	struct local_status status = {
+		.status = 0,
+		.length = len,
+	};
+	int ret;
+
+	ret = local_write_all(fd, &status, sizeof(status));
+	if (ret)
+		return ret;
+
+	return local_write_all(fd, buf, len);
+}
+
+static void jzboot_local_status(int fd, int ret, bool replied)
+{
+	struct local_status status = {
+		.status = ret,
+		.length = 0,
+	};
+
+	if (!replied)
+		local_write_all(fd, &status, sizeof(status));
+}
+
+static const struct jzboot_transport jzboot_local_transport = {
+	.read_events = jzboot_local_read_events,
+	.reply = jzboot_local_reply,
+	.status = jzboot_local_status,
+};
+
+/*
+ * The erase block size of a block device, as far as the kernel tells: its
+ * discard granularity, which is the erase group size of eMMC. Partitions
+ * have their queue attributes in the parent's directory.
+ */
+static size_t jzboot_erase_size(const struct stat *st)
+{
+	static const char * const attrs[] = {
+		"queue/discard_granularity",
+		"../queue/discard_granularity",
+	};
+	unsigned long erase_size = 0;
+	char path[128];
+	unsigned int i;
+	FILE *f;
+
+	for (i = 0; i < ARRAY_SIZE(attrs) && !erase_size; i++) {
+		snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s",
+			 major(st->st_rdev), minor(st->st_rdev), attrs[i]);
+
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+
+		if (fscanf(f, "%lu", &erase_size) != 1)
+			erase_size = 0;
+		fclose(f);
+	}
+
+	if (!erase_size)
+		return DIRECT_BUF_SIZE;
+
+	if (erase_size & (erase_size - 1)) {
+		printf("Erase size of %lu bytes is not a power of two, using %u\n",
+		       erase_size, DIRECT_BUF_SIZE);
+		return DIRECT_BUF_SIZE;
+	}
+
+	if (erase_size < DIRECT_ALIGN) {
+		printf("Erase size of %lu bytes is too small, using %u\n",
+		       erase_size, DIRECT_ALIGN);
+		return DIRECT_ALIGN;
+	}
+
+	if (erase_size > MAX_ERASE_SIZE) {
+		printf("Erase size of %lu bytes is too large, using %u\n",
+		       erase_size, MAX_ERASE_SIZE);
+		return MAX_ERASE_SIZE;
+	}
+
+	return erase_size;
+}
+
+/* Allocate the write buffer, large enough for a block of 'align' bytes */
+static int jzboot_wbuf_alloc(struct pdata *pdata, size_t align)
+{
+	size_t size = align > DIRECT_BUF_SIZE ? align : DIRECT_BUF_SIZE;
+	int ret;
+
+	if (pdata->wbuf && pdata->wbuf_size >= size)
+		return 0;
+
+	free(pdata->wbuf);
+	pdata->wbuf_size = 0;
+
+	ret = posix_memalign((void **)&pdata->wbuf, DIRECT_ALIGN, size);
+	if (ret) {
+		pdata->wbuf = NULL;
+		return -ret;
+	}
+
+	pdata->wbuf_size = size;
+
+	return 0;
+}
+
+/* Find out what the file was opened on, and prepare to write to it */
+static int jzboot_target_setup(struct pdata *pdata)
+{
+	struct stat st;
+	int ret;
+
+	if (fstat(pdata->data_fd, &st))
+		return -errno;
+
+	pdata->align = DIRECT_ALIGN;
+
+	if (S_ISREG(st.st_mode)) {
+		pdata->target = TARGET_FILE;
+	} else if (S_ISCHR(st.st_mode)) {
+		pdata->target = TARGET_UBI;
+		printf("Writing to a UBI volume\n");
+	} else if (S_ISBLK(st.st_mode)) {
+		pdata->target = TARGET_BLOCK;
+		pdata->align = jzboot_erase_size(&st);
+		printf("Writing to a block device, in blocks of %zu bytes\n",
+		       pdata->align);
+	} else {
+		return -EINVAL;
+	}
+
+	if (pdata->target == TARGET_BLOCK) {
+		ret = jzboot_wbuf_alloc(pdata, pdata->align);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Open the file with the given id for a transfer, without starting it.
+ * The file is released by jzboot_receive_file(), or by the caller if the
+ * transfer cannot be started.
+ */
+static int jzboot_file_open(struct pdata *pdata, unsigned int id,
+			    unsigned int open_flags)
+{
+	int ret, flags = O_RDWR | O_CREAT;
+	struct jzboot_resume *resume;
+	const char *fn;
+
+	if (id >= ARRAY_SIZE(jzboot_file_paths) || (open_flags & ~0xf))
+		return -EINVAL;
+
+	jzboot_file_path(id, pdata->path, sizeof(pdata->path));
+	fn = pdata->path;
+	pdata->open_flags = open_flags;
+	resume = &jzboot_resumes[id];
+
+	if ((open_flags & (OPEN_FLAG_LZ4 | OPEN_FLAG_RESUME)) &&
+	    !(open_flags & OPEN_FLAG_EXTENTS))
+		return -EINVAL;
+
+	if ((open_flags & OPEN_FLAG_RESUME) && !resume->file_size)
+		return -EINVAL;
+
+	if (!(open_flags & (OPEN_FLAG_KEEP | OPEN_FLAG_RESUME)))
+		flags |= O_TRUNC;
+
+	/* A missing device is an error, not a file to create in /dev */
+	if (jzboot_targets[id])
+		flags &= ~O_CREAT;
+
+	printf("Opening file: %s\n", fn);
+
+	ret = open(fn, flags, 0644);
+	if (ret == -1)
+		return -errno;
+
+	pdata->data_fd = ret;
+	pdata->fn = fn;
+	pdata->file_id = id;
+
+	ret = jzboot_target_setup(pdata);
+	if (ret) {
+		close(pdata->data_fd);
+		pdata->data_fd = -1;
+		return ret;
+	}
+
+	if ((pdata->direct && pdata->target == TARGET_FILE) ||
+	    pdata->target == TARGET_BLOCK) {
+		ret = jzboot_direct_open(pdata);
+		if (ret)
+			printf("Unable to use O_DIRECT, using buffered writes: %s\n",
+			       strerror(-ret));
+	}
+
+	pdata->digest = 0;
+	pdata->digest_offset = 0;
+	pdata->digest_valid = true;
+	pdata->resume_size = 0;
+
+	/* What was written before the interruption is already digested */
+	if (open_flags & OPEN_FLAG_RESUME) {
+		pdata->digest = le32toh(resume->crc32c);
+		pdata->digest_offset = le32toh(resume->offset);
+		pdata->resume_size = le32toh(resume->file_size);
+
+		printf("Resuming at %u of %u bytes\n",
+		       pdata->digest_offset, pdata->resume_size);
+	}
+
+	/* Whatever happens to this transfer, the old one is gone */
+	memset(resume, 0, sizeof(*resume));
+
+	jzboot_stats_open(pdata, id);
+
+	return 0;
+}
+
+/*
+ * Keep what was written of a file whose transfer failed, so that it can
+ * be resumed. Only the data covered by the digest is known to be there.
+ */
+static void jzboot_keep_partial(struct pdata *pdata)
+{
+	struct jzboot_resume *resume = &jzboot_resumes[pdata->file_id];
+	uint32_t file_size;
+
+	pthread_mutex_lock(&pdata->stats_lock);
+	file_size = pdata->stats.file_size;
+	pthread_mutex_unlock(&pdata->stats_lock);
+
+	if (!file_size || !pdata->digest_valid || !pdata->digest_offset ||
+	    pdata->digest_offset > file_size ||
+	    pdata->file_id == FILE_ID_SCRATCH)
+		return;
+
+	/* UBI marks the volume corrupted until another update completes */
+	if (pdata->target == TARGET_UBI)
+		return;
+
+	/* Write out what the direct I/O engine still holds */
+	if (jzboot_store_finish(pdata))
+		return;
+
+	resume->file_size = htole32(file_size);
+	resume->offset = htole32(pdata->digest_offset);
+	resume->crc32c = htole32(pdata->digest);
+
+	printf("Kept %u of %u bytes of %s\n",
+	       pdata->digest_offset, file_size, pdata->fn);
+}
+
+/* Close the file once its transfer is over, and publish its digest */
+static void jzboot_release_file(struct pdata *pdata, intptr_t retval)
+{
+	struct jzboot_digest *digest;
+
+	if (retval)
+		jzboot_keep_partial(pdata);
+
+	jzboot_direct_close(pdata);
+	close(pdata->data_fd);
+	pdata->data_fd = -1;
+
+	/* Only its digest is of any use */
+	if (pdata->file_id == FILE_ID_SCRATCH)
+		unlink(pdata->fn);
+
+	digest = &jzboot_digests[pdata->file_id];
+	digest->size = htole32(pdata->digest_offset);
+	digest->crc32c = htole32(pdata->digest);
+	digest->flags = htole32(!retval && pdata->digest_valid ?
+				DIGEST_VALID : 0);
+
+	if (retval)
+		printf("Transfer of %s failed with status %i\n",
+		       pdata->fn, (int)retval);
+}
+
+/*
+ * Check that the data fits, and start the update of a UBI volume, which
+ * then takes exactly 'data_size' bytes written in order.
+ */
+static int jzboot_target_prepare(struct pdata *pdata, uint32_t data_size)
+{
+	int64_t bytes = data_size;
+	uint64_t dev_size;
+
+	switch (pdata->target) {
+	case TARGET_FILE:
+		/* Reserve the space upfront, so that the file is not fragmented */
+		if (pdata->direct && data_size)
+			fallocate(pdata->data_fd, FALLOC_FL_KEEP_SIZE, 0, data_size);
+		break;
+	case TARGET_BLOCK:
+		if (ioctl(pdata->data_fd, BLKGETSIZE64, &dev_size))
+			return -errno;
+
+		if (data_size > dev_size) {
+			fprintf(stderr, "%s is too small for %u bytes\n",
+				pdata->fn, data_size);
+			return -ENOSPC;
+		}
+		break;
+	case TARGET_UBI:
+		if (ioctl(pdata->data_fd, UBI_IOCVOLUP, &bytes))
+			return -errno;
+		break;
+	}
+
+	return 0;
+}
+
+/* Receive the data of an open file, then release it */
+static int jzboot_receive_file(struct pdata *pdata, uint32_t data_size)
+{
+	int ret;
+
+	printf("Data size: %u bytes\n", data_size);
+
+	if (pdata->resume_size && data_size != pdata->resume_size) {
+		fprintf(stderr, "File size changed since the transfer was interrupted\n");
+		jzboot_release_file(pdata, -EINVAL);
+		return -EINVAL;
+	}
+
+	pthread_mutex_lock(&pdata->stats_lock);
+	pdata->stats.file_size = data_size;
+	pthread_mutex_unlock(&pdata->stats_lock);
+
+	ret = jzboot_target_prepare(pdata, data_size);
+	if (ret) {
+		jzboot_release_file(pdata, ret);
+		return ret;
+	}
+
+	if (pdata->open_flags & OPEN_FLAG_LZ4) {
+		ret = jzboot_receive_packed(pdata, data_size);
+	} else if (pdata->open_flags & OPEN_FLAG_EXTENTS) {
+		ret = jzboot_receive_extents(pdata, data_size);
+	} else {
+		ret = jzboot_receive(pdata, data_size);
+		if (!ret)
+			ret = jzboot_store_finish(pdata);
+	}
+
+	jzboot_progress_done(pdata);
+	jzboot_release_file(pdata, ret);
+
+	return ret;
+}
+
+static int jzboot_read_data(struct pdata *pdata)
+{
+	uint32_t data_size;
+	int ret;
+
+	ret = jzboot_read_all(pdata->ep_fd, &data_size, sizeof(data_size));
+	if (ret) {
+		fprintf(stderr, "Unable to read data size: %s\n",
+			strerror(-ret));
+		jzboot_release_file(pdata, ret);
+		return ret;
+	}
+
+	return jzboot_receive_file(pdata, le32toh(data_size));
+}
+
+/*
+ * Receive the files of a batch one after the other. The endpoint is read
+ * without a break, so that the host never waits for a file to be opened
+ * or closed.
+ */
+static int jzboot_read_batch(struct pdata *pdata)
+{
+	struct jzboot_batch_entry entry;
+	unsigned int id, nb_files = 0;
+	int ret;
+
+	for (;;) {
+		ret = jzboot_read_all(pdata->ep_fd, &entry, sizeof(entry));
+		if (ret) {
+			fprintf(stderr, "Unable to read batch entry: %s\n",
+				strerror(-ret));
+			break;
+		}
+
+		id = le32toh(entry.file_id);
+		if (id == BATCH_END)
+			break;
+
+		ret = jzboot_file_open(pdata, id, le32toh(entry.flags));
+		if (ret) {
+			fprintf(stderr, "Unable to open file %u: %s\n",
+				id, strerror(-ret));
+			break;
+		}
+
+		ret = jzboot_receive_file(pdata, le32toh(entry.size));
+		if (ret)
+			break;
+
+		nb_files++;
+	}
+
+	printf("Received a batch of %u file(s)\n", nb_files);
+
+	return ret;
+}
+
+/*
+ * The stream's worker runs its jobs one at a time, and signals their end
+ * through 'done_fd', so that ep0 is never blocked on the data.
+ */
+static void * jzboot_worker(void *d)
+{
+	struct pdata *pdata = d;
+	enum jzboot_job job;
+	uint64_t e = 1;
+	int ret;
+
+	for (;;) {
+		pthread_mutex_lock(&pdata->job_lock);
+		while (pdata->job == JOB_NONE)
+			pthread_cond_wait(&pdata->job_cond, &pdata->job_lock);
+		job = pdata->job;
+		pthread_mutex_unlock(&pdata->job_lock);
+
+		if (job == JOB_EXIT)
+			break;
+
+		jzboot_aborted = 0;
+
+		if (job == JOB_BATCH)
+			ret = jzboot_read_batch(pdata);
+		else
+			ret = jzboot_read_data(pdata);
+
+		pthread_mutex_lock(&pdata->job_lock);
+		pdata->job = JOB_NONE;
+		pdata->job_status = ret;
+		pdata->job_done = true;
+		pthread_cond_broadcast(&pdata->job_cond);
+		pthread_mutex_unlock(&pdata->job_lock);
+
+		do {
+			ret = write(done_fd, &e, sizeof(e));
+		} while (ret == -1 && errno == EINTR);
+	}
+
+	return NULL;
+}
+
+/* Hand a job to the stream's worker, which is started on first use */
+static int jzboot_submit(struct pdata *pdata, enum jzboot_job job)
+{
+	int ret;
+
+	if (!pdata->worker) {
+		ret = pthread_create(&pdata->thd, NULL, jzboot_worker, pdata);
+		if (ret)
+			return -ret;
+
+		pdata->worker = true;
+	}
+
+	pthread_mutex_lock(&pdata->job_lock);
+	pdata->job = job;
+	pdata->job_done = false;
+	pthread_cond_broadcast(&pdata->job_cond);
+	pthread_mutex_unlock(&pdata->job_lock);
+
+	pdata->busy = true;
+
+	return 0;
+}
+
+/* Collect the status of the stream's job, if it is over */
+static void jzboot_reap_job(struct pdata *pdata)
+{
+	bool done;
+	int status;
+
+	pthread_mutex_lock(&pdata->job_lock);
+	done = pdata->job_done;
+	status = pdata->job_status;
+	pdata->job_done = false;
+	pthread_mutex_unlock(&pdata->job_lock);
+
+	if (!done)
+		return;
+
+	pdata->busy = false;
+
+	if (status)
+		printf("Stream %u: transfer failed: %s\n",
+		       pdata->index, strerror(-status));
+}
+
+static void jzboot_reap_jobs(struct pdata *streams, unsigned int nb_streams)
+{
+	unsigned int i;
+	uint64_t nb;
+
+	read(done_fd, &nb, sizeof(nb));
+
+	for (i = 0; i < nb_streams; i++) {
+		if (streams[i].busy)
+			jzboot_reap_job(&streams[i]);
+	}
+}
+
+static int jzboot_open_file(struct pdata *pdata,
+			    const struct usb_ctrlrequest *req)
+{
+	uint16_t wValue = le16toh(req->wValue);
+	int ret;
+
+	/* A client that lost its link sends CMD_ABORT first */
+	if (pdata->busy)
+		return -EBUSY;
+
+	ret = jzboot_file_open(pdata, WVALUE_FILE_ID(wValue),
+			       WVALUE_OPEN_FLAGS(wValue));
+	if (ret)
+		return ret;
+
+	ret = jzboot_submit(pdata, JOB_FILE);
+	if (ret)
+		jzboot_release_file(pdata, ret);
+
+	return ret;
+}
+
+static int jzboot_open_batch(struct pdata *pdata,
+			     const struct usb_ctrlrequest *req)
+{
+	if (pdata->busy)
+		return -EBUSY;
+
+	return jzboot_submit(pdata, JOB_BATCH);
+}
+
+/*
+ * The host expects the file to be written once CMD_CLOSE_FILE completes.
+ * If the worker is not done yet, -EINPROGRESS defers the status until it
+ * is, and ep0 is left alone meanwhile.
+ */
+static int jzboot_close_file(struct pdata *pdata,
+			     const struct usb_ctrlrequest *req)
+{
+	if (!pdata->busy)
+		return 0;
+
+	pdata->close_pending = true;
+
+	return -EINPROGRESS;
+}
+
+static void jzboot_abort_handler(int sig)
+{
+	jzboot_aborted = 1;
+}
+
+/*
+ * Stop the transfer of a client that went away. Reads that are pending
+ * fail, but the worker may be about to start a new one, which would wait
+ * for the host to come back; so it is interrupted until its job is over.
+ */
+static void jzboot_abort_file(struct pdata *pdata)
+{
+	struct timespec deadline;
+
+	if (!pdata->busy)
+		return;
+
+	pthread_mutex_lock(&pdata->job_lock);
+
+	while (!pdata->job_done) {
+		pthread_kill(pdata->thd, SIGUSR1);
+
+		/* In case it waits for the other streams to free memory */
+		pthread_mutex_lock(&unpack_mem.lock);
+		pthread_cond_broadcast(&unpack_mem.cond);
+		pthread_mutex_unlock(&unpack_mem.lock);
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += ABORT_RETRY_MS * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		pthread_cond_timedwait(&pdata->job_cond, &pdata->job_lock,
+				       &deadline);
+	}
+
+	pthread_mutex_unlock(&pdata->job_lock);
+
+	jzboot_reap_job(pdata);
+	pdata->close_pending = false;
+}
+
+/* Stop the transfers of a client that went away, and close its files */
+static void jzboot_abort_files(struct pdata *streams, unsigned int nb_streams)
+{
+	unsigned int i;
+
+	for (i = 0; i < nb_streams; i++) {
+		shutdown(streams[i].ep_fd, SHUT_RD);
+		jzboot_abort_file(&streams[i]);
+	}
+}
+
+/*
+ * The client lost its link and came back, while the streams may still be
+ * waiting for the rest of its files. Stop them, so that it can open the
+ * files again; what was written is kept for CMD_GET_RESUME.
+ */
+static int jzboot_abort(struct pdata *streams, unsigned int nb_streams)
+{
+	unsigned int i;
+
+	for (i = 0; i < nb_streams; i++)
+		jzboot_abort_file(&streams[i]);
+
+	return 0;
+}
+
+/*
+ * Hash one page of blocks of an existing file, so that the client can
+ * only send the blocks that changed. The page number is passed in the
+ * high byte of wValue, and the number of blocks per page depends on
+ * wLength. A missing file is reported with a size of zero.
+ */
+static int jzboot_hash_manifest(struct jzboot_manifest_job *job)
+{
+	uint32_t i, per_page, first, count = 0, size = 0;
+	struct jzboot_manifest *manifest;
+	uint64_t *hashes;
+	char *block, fn[256];
+	struct stat st;
+	ssize_t ret;
+	int fd;
+
+	per_page = (job->length - sizeof(*manifest)) / sizeof(*hashes);
+	first = job->page * per_page;
+
+	manifest = malloc(job->length);
+	block = malloc(MANIFEST_BLOCK_SIZE);
+	if (!manifest || !block) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	hashes = (uint64_t *)(manifest + 1);
+
+	jzboot_file_path(job->id, fn, sizeof(fn));
+
+	fd = open(fn, O_RDONLY);
+	if (fd >= 0 && !fstat(fd, &st))
+		size = st.st_size;
+
+	for (i = first; (uint64_t)i * MANIFEST_BLOCK_SIZE < size &&
+	     count < per_page; i++, count++) {
+		ret = pread(fd, block, MANIFEST_BLOCK_SIZE,
+			    (off_t)i * MANIFEST_BLOCK_SIZE);
+		if (ret < 0) {
+			ret = -errno;
+			close(fd);
+			goto out_free;
+		}
+
+		hashes[count] = htole64(xxh64(block, ret, 0));
+	}
+
+	if (fd >= 0)
+		close(fd);
+
+	manifest->file_size = htole32(size);
+	manifest->block_size = htole32(MANIFEST_BLOCK_SIZE);
+	manifest->nb_blocks = htole32((size + MANIFEST_BLOCK_SIZE - 1) /
+				      MANIFEST_BLOCK_SIZE);
+	manifest->first_block = htole32(first);
+
+	job->manifest = manifest;
+	job->len = sizeof(*manifest) + count * sizeof(*hashes);
+	manifest = NULL;
+	ret = 0;
+
+out_free:
+	free(block);
+	free(manifest);
+	return ret;
+}
+
+static void * jzboot_manifest_thread(void *d)
+{
+	struct jzboot_manifest_job *job = d;
+	uint64_t e = 1;
+	int ret;
+
+	ret = jzboot_hash_manifest(job);
+
+	pthread_mutex_lock(&job->lock);
+	job->status = ret;
+	job->done = true;
+	pthread_mutex_unlock(&job->lock);
+
+	do {
+		ret = write(done_fd, &e, sizeof(e));
+	} while (ret == -1 && errno == EINTR);
+
+	return NULL;
+}
+
+/*
+ * Reading and hashing a page of blocks takes a while, so it is done in a
+ * thread, and -EINPROGRESS defers the reply until it is over.
+ */
+static int jzboot_get_manifest(struct pdata *pdata,
+			       const struct usb_ctrlrequest *req)
+{
+	struct jzboot_manifest_job *job = &manifest_job;
+	uint16_t length = le16toh(req->wLength);
+	int ret;
+
+	if ((le16toh(req->wValue) & 0xff) >= ARRAY_SIZE(jzboot_file_paths) ||
+	    length < sizeof(struct jzboot_manifest) + sizeof(uint64_t))
+		return -EINVAL;
+
+	job->id = le16toh(req->wValue) & 0xff;
+	job->page = le16toh(req->wValue) >> 8;
+	job->length = length;
+	job->manifest = NULL;
+	job->done = false;
+
+	ret = pthread_create(&job->thd, NULL, jzboot_manifest_thread, job);
+	if (ret)
+		return -ret;
+
+	job->pending = true;
+
+	return -EINPROGRESS;
+}
+
+/* Send the page of a deferred CMD_GET_MANIFEST; returns true if pending */
+static bool jzboot_manifest_pending(struct pdata *pdata, int ep0_fd)
+{
+	struct jzboot_manifest_job *job = &manifest_job;
+	bool done;
+	int ret;
+
+	if (!job->pending)
+		return false;
+
+	pthread_mutex_lock(&job->lock);
+	done = job->done;
+	pthread_mutex_unlock(&job->lock);
+
+	if (!done)
+		return true;
+
+	pthread_join(job->thd, NULL);
+	job->pending = false;
+
+	ep0_replied = false;
+	ret = job->status;
+	if (!ret)
+		ret = jzboot_ep0_reply(pdata, job->manifest, job->len);
+
+	transport->status(ep0_fd, ret, ep0_replied);
+
+	if (ret)
+		fprintf(stderr, "Unable to hash manifest: %s\n", strerror(-ret));
+
+	free(job->manifest);
+	job->manifest = NULL;
+
+	return false;
+}
+
+/* Wait for a deferred CMD_GET_MANIFEST whose client is gone */
+static void jzboot_manifest_cancel(void)
+{
+	struct jzboot_manifest_job *job = &manifest_job;
+
+	if (!job->pending)
+		return;
+
+	pthread_join(job->thd, NULL);
+	job->pending = false;
+
+	free(job->manifest);
+	job->manifest = NULL;
+}
+
+static int jzboot_get_digest(struct pdata *pdata,
+			     const struct usb_ctrlrequest *req)
 {
-	int ret;
+	unsigned int id = WVALUE_FILE_ID(le16toh(req->wValue));
 
-	do {
-		ret = poll(pfd, num_pfd, -1);
-	} while (ret == -1 && errno == EINTR);
+	if (id >= ARRAY_SIZE(jzboot_digests))
+		return -EINVAL;
 
-	return ret;
+	return jzboot_ep0_reply(pdata, &jzboot_digests[id],
+				sizeof(jzboot_digests[id]));
 }
 
-static const char * const jzboot_file_paths[] = {
-	"/boot/rootfs.squashfs",
-	"/boot/uzImage.bin",
-	"/boot/devicetree.dtb",
-	"/boot/ubiboot.bin",
-	"/boot/mininit-syspart",
-	"/boot/modules.squashfs",
-};
-
-static void * jzboot_read_data(void *d)
+static int jzboot_get_resume(struct pdata *pdata,
+			     const struct usb_ctrlrequest *req)
 {
-	struct pdata *pdata = d;
-	uint32_t data_size, transfer_size;
-	ssize_t ret;
-	char buf[4096];
+	unsigned int id = WVALUE_FILE_ID(le16toh(req->wValue));
 
-	ret = read(pdata->ep1_fd, (unsigned char *)&data_size,
-		   sizeof(&data_size));
-	if (ret < 0) {
-		ret = -errno;
-		fprintf(stderr, "Unable to read data size: %s\n",
-			strerror(-ret));
-		return (void *)ret;
+	if (id >= ARRAY_SIZE(jzboot_resumes))
+		return -EINVAL;
+
+	return jzboot_ep0_reply(pdata, &jzboot_resumes[id],
+				sizeof(jzboot_resumes[id]));
+}
+
+static int jzboot_get_stats(struct pdata *streams, unsigned int nb_streams,
+			    const struct usb_ctrlrequest *req)
+{
+	struct jzboot_stats stats[MAX_STREAMS], *st;
+	uint16_t length = le16toh(req->wLength);
+	struct timespec now;
+	unsigned int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	/* Only reply with the entries that fit */
+	if (nb_streams > length / sizeof(*st))
+		nb_streams = length / sizeof(*st);
+
+	for (i = 0; i < nb_streams; i++) {
+		st = &stats[i];
+
+		pthread_mutex_lock(&streams[i].stats_lock);
+		*st = streams[i].stats;
+		pthread_mutex_unlock(&streams[i].stats_lock);
+
+		if (st->flags & STATS_ACTIVE)
+			st->elapsed_ms = elapsed_us(&streams[i].opened, &now) / 1000;
+
+		st->flags = htole32(st->flags);
+		st->file_id = htole32(st->file_id);
+		st->file_size = htole32(st->file_size);
+		st->elapsed_ms = htole32(st->elapsed_ms);
+		st->bytes = htole64(st->bytes);
+		st->total_bytes = htole64(st->total_bytes);
+		st->nb_chunks = htole32(st->nb_chunks);
+		st->max_chunk_us = htole32(st->max_chunk_us);
+		st->chunk_us = htole64(st->chunk_us);
+		st->nb_stalls = htole32(st->nb_stalls);
 	}
 
-	printf("Data size: %u bytes\n", data_size);
+	return jzboot_ep0_reply(&streams[0], stats, nb_streams * sizeof(*st));
+}
 
-	for (transfer_size = data_size; transfer_size; ) {
-		uint32_t bytes_read, to_read = transfer_size;
-		unsigned long percent;
+/*
+ * Resize the reads of one stream; its AIO requests are set up again. If
+ * that fails, the old parameters are kept and the error reported; only if
+ * AIO can't even be set up again with those does it fall back to read().
+ */
+static int jzboot_set_rx_params(struct pdata *pdata, unsigned int rx_depth,
+				unsigned int rx_buf_size)
+{
+	unsigned int old_depth = pdata->rx_depth;
+	unsigned int old_buf_size = pdata->rx_buf_size;
+	int ret;
 
-		if (to_read > sizeof(buf))
-			to_read = sizeof(buf);
+	if (pdata->rx_mode == RX_MODE_SPLICE)
+		fcntl(pdata->pipe_fds[1], F_SETPIPE_SZ, rx_buf_size);
 
-		ret = read(pdata->ep1_fd, buf, to_read);
-		if (ret == -1) {
-			ret = -errno;
-			break;
-		}
+	if (pdata->rx_mode != RX_MODE_AIO) {
+		pdata->rx_depth = rx_depth;
+		pdata->rx_buf_size = rx_buf_size;
+		return 0;
+	}
 
-		bytes_read = ret;
+	jzboot_aio_cleanup(pdata);
 
-		ret = write(pdata->data_fd, buf, bytes_read);
-		if (ret == -1) {
-			ret = -errno;
-			break;
-		}
+	pdata->rx_depth = rx_depth;
+	pdata->rx_buf_size = rx_buf_size;
 
-		transfer_size -= ret;
-		ret = 0;
+	ret = jzboot_aio_setup(pdata);
+	if (!ret)
+		return 0;
 
-		percent = (data_size - transfer_size) * 100ull / data_size;
-		printf("\r%s: %lu%%", pdata->fn, percent);
-		fflush(stdout);
-	}
+	pdata->rx_depth = old_depth;
+	pdata->rx_buf_size = old_buf_size;
 
-	printf("\n");
+	if (jzboot_aio_setup(pdata)) {
+		printf("Unable to setup AIO, falling back to read(): %s\n",
+		       strerror(-ret));
+		pdata->rx_mode = RX_MODE_COPY;
+	}
 
-	return (void *)ret;
+	return ret;
 }
 
-static int jzboot_open_file(struct pdata *pdata,
+static int jzboot_set_param(struct pdata *streams, unsigned int nb_streams,
 			    const struct usb_ctrlrequest *req)
 {
-	const char *fn = jzboot_file_paths[le16toh(req->wValue)];
+	unsigned int i, value = WVALUE_PARAM_VALUE(le16toh(req->wValue));
+	unsigned int rx_depth = streams[0].rx_depth;
 	int ret;
+	unsigned int rx_buf_size = streams[0].rx_buf_size;
 
-	printf("Opening file: %s\n", fn);
+	for (i = 0; i < nb_streams; i++) {
+		if (streams[i].busy)
+			return -EBUSY;
+	}
 
-	ret = open(fn, O_WRONLY | O_TRUNC | O_CREAT);
-	if (ret == -1)
-		return -errno;
+	switch (WVALUE_PARAM(le16toh(req->wValue))) {
+	case PARAM_RX_BUF_SIZE:
+		if (!value || value * 1024 > MAX_RX_BUF_SIZE)
+			return -EINVAL;
+
+		rx_buf_size = value * 1024;
+
+		/* The depth is set next; don't overshoot the cap meanwhile */
+		if (rx_depth * rx_buf_size > MAX_RX_QUEUE_SIZE)
+			rx_depth = MAX_RX_QUEUE_SIZE / rx_buf_size;
+		break;
+	case PARAM_RX_DEPTH:
+		if (!value || value > MAX_RX_DEPTH ||
+		    value * rx_buf_size > MAX_RX_QUEUE_SIZE)
+			return -EINVAL;
+
+		rx_depth = value;
+		break;
+	default:
+		return -EINVAL;
+	}
 
-	pdata->data_fd = ret;
-	pdata->fn = fn;
+	printf("Receiving with %u request(s) of %u KiB\n",
+	       rx_depth, rx_buf_size / 1024);
 
-	ret = pthread_create(&pdata->thd, NULL, jzboot_read_data, pdata);
-	if (ret) {
-		close(pdata->data_fd);
-		return ret;
+	for (i = 0; i < nb_streams; i++) {
+		ret = jzboot_set_rx_params(&streams[i], rx_depth, rx_buf_size);
+		if (ret)
+			return ret;
 	}
 
 	return 0;
 }
 
-static void jzboot_close_file(struct pdata *pdata,
-			      const struct usb_ctrlrequest *req)
+static int jzboot_get_features(struct pdata *pdata,
+			       const struct usb_ctrlrequest *req)
 {
-	int retval;
-
-	pthread_join(pdata->thd, (void **)&retval);
-
-	close(pdata->data_fd);
-	pdata->data_fd = -1;
+	uint32_t features = htole32(FEATURE_LZ4 | FEATURE_BATCH |
+				    FEATURE_SCRATCH | FEATURE_ABORT);
 
-	if (retval)
-		printf("Read thread exited with status %i\n", retval);
+	return jzboot_ep0_reply(pdata, &features, sizeof(features));
 }
 
 static void jzboot_exit(void)
@@ -184,31 +2634,64 @@ static void jzboot_exit(void)
 	} while (ret == -1 && errno == EINTR);
 }
 
-static int handle_event(struct pdata *pdata,
-			const struct usb_functionfs_event *event)
+static int handle_setup(struct pdata *streams, unsigned int nb_streams,
+			const struct usb_ctrlrequest *req)
 {
+	unsigned int stream;
 	int ret = 0;
 
-	if (event->type == FUNCTIONFS_SETUP) {
-		const struct usb_ctrlrequest *req = &event->u.setup;
-
-		switch (req->bRequest) {
-		case CMD_EXIT:
-			jzboot_exit();
-			break;
-		case CMD_OPEN_FILE:
-			ret = jzboot_open_file(pdata, req);
-			break;
-		case CMD_CLOSE_FILE:
-			jzboot_close_file(pdata, req);
-			break;
-		}
+	stream = WVALUE_STREAM(le16toh(req->wValue));
+
+	switch (req->bRequest) {
+	case CMD_EXIT:
+		jzboot_exit();
+		break;
+	case CMD_OPEN_FILE:
+		if (stream >= nb_streams)
+			return -EINVAL;
+
+		ret = jzboot_open_file(&streams[stream], req);
+		break;
+	case CMD_OPEN_BATCH:
+		if (stream >= nb_streams)
+			return -EINVAL;
+
+		ret = jzboot_open_batch(&streams[stream], req);
+		break;
+	case CMD_CLOSE_FILE:
+		if (stream >= nb_streams)
+			return -EINVAL;
+
+		ret = jzboot_close_file(&streams[stream], req);
+		break;
+	case CMD_GET_MANIFEST:
+		ret = jzboot_get_manifest(&streams[0], req);
+		break;
+	case CMD_GET_DIGEST:
+		ret = jzboot_get_digest(&streams[0], req);
+		break;
+	case CMD_GET_STATS:
+		ret = jzboot_get_stats(streams, nb_streams, req);
+		break;
+	case CMD_SET_PARAM:
+		ret = jzboot_set_param(streams, nb_streams, req);
+		break;
+	case CMD_GET_FEATURES:
+		ret = jzboot_get_features(&streams[0], req);
+		break;
+	case CMD_GET_RESUME:
+		ret = jzboot_get_resume(&streams[0], req);
+		break;
+	case CMD_ABORT:
+		ret = jzboot_abort(streams, nb_streams);
+		break;
 	}
 
 	return ret;
 }
 
-static struct usb_ffs_header * create_header(uint32_t size)
+static struct usb_ffs_header * create_header(uint32_t size,
+					     unsigned int nb_streams)
 {
 	/* Packet sizes for USB high-speed, full-speed, super-speed */
 	const unsigned int packet_sizes[3] = { 64, 512, 1024, };
@@ -216,7 +2699,7 @@ static struct usb_ffs_header * create_header(uint32_t size)
 	struct usb_ss_ep_comp_descriptor *comp;
 	struct usb_interface_descriptor *desc;
 	struct usb_ffs_header *hdr;
-	unsigned int i, pipe_id;
+	unsigned int i, j;
 
 	hdr = calloc(1, size);
 	if (!hdr) {
@@ -230,9 +2713,9 @@ static struct usb_ffs_header * create_header(uint32_t size)
 				 FUNCTIONFS_HAS_HS_DESC |
 				 FUNCTIONFS_HAS_SS_DESC);
 
-	hdr->nb_fs = htole32(2);
-	hdr->nb_hs = htole32(2);
-	hdr->nb_ss = htole32(3);
+	hdr->nb_fs = htole32(1 + nb_streams);
+	hdr->nb_hs = htole32(1 + nb_streams);
+	hdr->nb_ss = htole32(1 + 2 * nb_streams);
 
 	desc = ((void *) hdr) + sizeof(*hdr);
 
@@ -240,39 +2723,44 @@ static struct usb_ffs_header * create_header(uint32_t size)
 		desc->bLength = sizeof(*desc);
 		desc->bDescriptorType = USB_DT_INTERFACE;
 		desc->bInterfaceClass = USB_CLASS_COMM;
-		desc->bNumEndpoints = 1;
+		desc->bNumEndpoints = nb_streams;
 		desc->iInterface = 1;
 
 		ep = (struct usb_endpoint_descriptor_no_audio *)(desc + 1);
 
-		ep->bLength = sizeof(*ep);
-		ep->bDescriptorType = USB_DT_ENDPOINT;
-		ep->bEndpointAddress = 1 | USB_DIR_OUT;
-		ep->bmAttributes = USB_ENDPOINT_XFER_BULK;
-		ep->wMaxPacketSize = htole16(packet_sizes[i]);
-
-		if (i == 2) {
-			comp = (struct usb_ss_ep_comp_descriptor *)(ep + 1);
-			comp->bLength = USB_DT_SS_EP_COMP_SIZE;
-			comp->bDescriptorType = USB_DT_SS_ENDPOINT_COMP;
+		for (j = 0; j < nb_streams; j++) {
+			ep->bLength = sizeof(*ep);
+			ep->bDescriptorType = USB_DT_ENDPOINT;
+			ep->bEndpointAddress = (j + 1) | USB_DIR_OUT;
+			ep->bmAttributes = USB_ENDPOINT_XFER_BULK;
+			ep->wMaxPacketSize = htole16(packet_sizes[i]);
+
+			if (i == 2) {
+				comp = (struct usb_ss_ep_comp_descriptor *)(ep + 1);
+				comp->bLength = USB_DT_SS_EP_COMP_SIZE;
+				comp->bDescriptorType = USB_DT_SS_ENDPOINT_COMP;
+				ep = (void *)(comp + 1);
+			} else {
+				ep++;
+			}
 		}
 
-		desc = (void *)(desc + 1) + sizeof(*ep);
+		desc = (void *)ep;
 	}
 
 	return hdr;
 }
 
-static int write_header(int fd)
+static int write_header(int fd, unsigned int nb_streams)
 {
 	uint32_t size = sizeof(struct usb_ffs_header) +
 		3 * sizeof(struct usb_interface_descriptor) +
-		3 * sizeof(struct usb_endpoint_descriptor_no_audio) +
-		1 * sizeof(struct usb_ss_ep_comp_descriptor);
+		3 * nb_streams * sizeof(struct usb_endpoint_descriptor_no_audio) +
+		nb_streams * sizeof(struct usb_ss_ep_comp_descriptor);
 	struct usb_ffs_header *hdr;
 	int ret;
 
-	hdr = create_header(size);
+	hdr = create_header(size, nb_streams);
 	if (!hdr)
 		return -errno;
 
@@ -288,6 +2776,117 @@ static int write_header(int fd)
 	return 0;
 }
 
+static void jzboot_stream_setup(struct pdata *pdata)
+{
+	int ret;
+
+	pthread_mutex_init(&pdata->stats_lock, NULL);
+	pthread_mutex_init(&pdata->job_lock, NULL);
+	pthread_cond_init(&pdata->job_cond, NULL);
+
+	if (pdata->direct) {
+		ret = jzboot_wbuf_alloc(pdata, DIRECT_ALIGN);
+		if (ret) {
+			printf("Unable to allocate write buffer, using buffered writes: %s\n",
+			       strerror(-ret));
+			pdata->direct = false;
+		}
+	}
+
+	/* Spliced data would bypass the write engine */
+	if (pdata->direct && pdata->rx_mode == RX_MODE_SPLICE) {
+		printf("splice() cannot be used with direct I/O, using AIO\n");
+		pdata->rx_mode = RX_MODE_AIO;
+	}
+
+	/* AIO reads from a socket complete synchronously anyway */
+	if (pdata->rx_mode == RX_MODE_AIO && !transport->aio)
+		pdata->rx_mode = RX_MODE_COPY;
+
+	if (pdata->rx_mode == RX_MODE_AIO) {
+		ret = jzboot_aio_setup(pdata);
+		if (ret) {
+			printf("Unable to setup AIO, falling back to read(): %s\n",
+			       strerror(-ret));
+			pdata->rx_mode = RX_MODE_COPY;
+		}
+	} else if (pdata->rx_mode == RX_MODE_SPLICE) {
+		ret = jzboot_splice_setup(pdata);
+		if (ret) {
+			printf("Unable to create pipe, falling back to read(): %s\n",
+			       strerror(-ret));
+			pdata->rx_mode = RX_MODE_COPY;
+		}
+	}
+}
+
+static void jzboot_stream_cleanup(struct pdata *pdata)
+{
+	if (pdata->worker) {
+		jzboot_abort_file(pdata);
+
+		pthread_mutex_lock(&pdata->job_lock);
+		pdata->job = JOB_EXIT;
+		pthread_cond_broadcast(&pdata->job_cond);
+		pthread_mutex_unlock(&pdata->job_lock);
+
+		pthread_join(pdata->thd, NULL);
+	}
+
+	if (pdata->rx_mode == RX_MODE_AIO)
+		jzboot_aio_cleanup(pdata);
+	else if (pdata->rx_mode == RX_MODE_SPLICE)
+		jzboot_splice_cleanup(pdata);
+
+	free(pdata->wbuf);
+	close(pdata->ep_fd);
+	pthread_cond_destroy(&pdata->job_cond);
+	pthread_mutex_destroy(&pdata->job_lock);
+	pthread_mutex_destroy(&pdata->stats_lock);
+}
+
+/* Open ep0, write the descriptors, then open the bulk OUT endpoints */
+static int jzboot_ffs_open(const char *mountpoint, unsigned int nb_streams,
+			   int *ep0_fd, int *ep_fds)
+{
+	unsigned int i;
+	char buf[256];
+	int ret;
+
+	snprintf(buf, sizeof(buf), "%s/ep0", mountpoint);
+	*ep0_fd = open(buf, O_RDWR);
+	if (*ep0_fd < 0) {
+		ret = -errno;
+		printf("Unable to open ep0: %s\n", strerror(-ret));
+		return ret;
+	}
+
+	ret = write_header(*ep0_fd, nb_streams);
+	if (ret < 0) {
+		printf("Unable to write header: %s\n", strerror(-ret));
+		goto err_close_ep0;
+	}
+
+	for (i = 0; i < nb_streams; i++) {
+		snprintf(buf, sizeof(buf), "%s/ep%u", mountpoint, i + 1);
+		ep_fds[i] = open(buf, O_RDONLY);
+		if (ep_fds[i] < 0) {
+			ret = -errno;
+			printf("Unable to open ep%u: %s\n", i + 1, strerror(-ret));
+			goto err_close_eps;
+		}
+	}
+
+	return 0;
+
+err_close_eps:
+	while (i--)
+		close(ep_fds[i]);
+err_close_ep0:
+	close(*ep0_fd);
+	return ret;
+}
+
 static void set_handler(int signal, void (*handler)(int))
 {
 	struct sigaction sig;
@@ -302,97 +2901,415 @@ static void sig_handler(int sig)
 	jzboot_exit();
 }
 
+static const char * const jzboot_state_names[] = {
+	[STATE_UNBOUND] = "unbound",
+	[STATE_BOUND] = "bound",
+	[STATE_ENABLED] = "enabled",
+	[STATE_SUSPENDED] = "suspended",
+};
+
+static void jzboot_set_state(enum jzboot_state state)
+{
+	if (state == gadget_state)
+		return;
+
+	printf("Gadget %s\n", jzboot_state_names[state]);
+	gadget_state = state;
+}
+
+/*
+ * Follow the gadget through the host's lifecycle events. When the host
+ * goes away, the data it had in flight is lost: the transfers are aborted,
+ * and can be resumed once it is back. A suspended bus loses nothing, so
+ * the transfers simply wait for it to resume. The endpoints stay open all
+ * along, and are usable again as soon as the host re-enables the gadget.
+ */
+static void handle_lifecycle(struct pdata *streams, unsigned int nb_streams,
+			     unsigned int type)
+{
+	unsigned int i;
+
+	switch (type) {
+	case FUNCTIONFS_BIND:
+		jzboot_set_state(STATE_BOUND);
+		break;
+	case FUNCTIONFS_UNBIND:
+		jzboot_abort_files(streams, nb_streams);
+		jzboot_set_state(STATE_UNBOUND);
+		break;
+	case FUNCTIONFS_ENABLE:
+		jzboot_set_state(STATE_ENABLED);
+		break;
+	case FUNCTIONFS_DISABLE:
+		jzboot_abort_files(streams, nb_streams);
+		jzboot_set_state(STATE_BOUND);
+		break;
+	case FUNCTIONFS_SUSPEND:
+		if (gadget_state == STATE_ENABLED)
+			jzboot_set_state(STATE_SUSPENDED);
+		break;
+	case FUNCTIONFS_RESUME:
+		if (gadget_state != STATE_SUSPENDED)
+			break;
+
+		for (i = 0; i < nb_streams; i++) {
+			pthread_mutex_lock(&streams[i].stats_lock);
+			streams[i].resumed = true;
+			pthread_mutex_unlock(&streams[i].stats_lock);
+		}
+
+		jzboot_set_state(STATE_ENABLED);
+		break;
+	}
+}
+
+/* Complete the CMD_CLOSE_FILE whose stream is done; returns true if pending */
+static bool jzboot_close_pending(struct pdata *streams, unsigned int nb_streams,
+				 int ep0_fd)
+{
+	unsigned int i;
+
+	for (i = 0; i < nb_streams; i++) {
+		if (!streams[i].close_pending)
+			continue;
+
+		if (streams[i].busy)
+			return true;
+
+		streams[i].close_pending = false;
+		transport->status(ep0_fd, 0, false);
+	}
+
+	return false;
+}
+
+/*
+ * Handle the requests on ep0 until CMD_EXIT or a signal, which return 0,
+ * or until the client goes away, which returns -EPIPE. The end of the
+ * workers' jobs and of the manifest thread is handled in the same loop.
+ */
+static int jzboot_serve(struct pdata *streams, unsigned int nb_streams,
+			int ep0_fd)
+{
+	struct usb_functionfs_event events[MAX_EP0_EVENTS];
+	struct pollfd pfd[3];
+	bool deferred = false;
+	int i, ret, nb;
+
+	for (;;) {
+		/* The status of a deferred request is still owed to ep0 */
+		pfd[0].fd = deferred ? -1 : ep0_fd;
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+		pfd[1].fd = stop_fd;
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
+		pfd[2].fd = done_fd;
+		pfd[2].events = POLLIN;
+		pfd[2].revents = 0;
+
+		poll_nointr(pfd, 3);
+
+		if (pfd[1].revents & POLLIN) { /* STOP event */
+			jzboot_manifest_cancel();
+			return 0;
+		}
+
+		if (pfd[2].revents & POLLIN) {
+			jzboot_reap_jobs(streams, nb_streams);
+			deferred = jzboot_close_pending(streams, nb_streams,
+							ep0_fd) ||
+				   jzboot_manifest_pending(&streams[0], ep0_fd);
+		}
+
+		if (!(pfd[0].revents & (POLLIN | POLLHUP)))
+			continue;
+
+		nb = transport->read_events(ep0_fd, events, MAX_EP0_EVENTS);
+		if (nb == -EAGAIN)
+			continue;
+		if (nb < 0) /* The client went away */
+			return -EPIPE;
+
+		for (i = 0; i < nb; i++) {
+			if (events[i].type != FUNCTIONFS_SETUP) {
+				handle_lifecycle(streams, nb_streams, events[i].type);
+				continue;
+			}
+
+			ep0_replied = false;
+			ep0_in = events[i].u.setup.bRequestType & USB_DIR_IN;
+
+			ret = handle_setup(streams, nb_streams, &events[i].u.setup);
+			if (ret == -EINPROGRESS) {
+				deferred = true;
+				continue;
+			}
+
+			transport->status(ep0_fd, ret, ep0_replied);
+
+			/* The request is rejected, the client can go on */
+			if (ret)
+				fprintf(stderr, "Unable to handle request %u: %s\n",
+					events[i].u.setup.bRequest, strerror(-ret));
+		}
+	}
+}
+
+/*
+ * Serve the clients of a local or TCP socket one after the other. They all
+ * write the same files, so the next one waits in the backlog; a client
+ * that fails or sends bad requests only ends its own session.
+ */
+static int jzboot_serve_local(const struct pdata *pdata,
+			      unsigned int nb_streams,
+			      const struct local_addr *addr, const char *name)
+{
+	struct pdata streams[MAX_STREAMS];
+	int ret, listen_fd, ep0_fd, ep_fds[MAX_STREAMS];
+	unsigned int i;
+
+	transport = &jzboot_local_transport;
+	gadget_state = STATE_ENABLED;
+
+	listen_fd = local_listen(addr);
+	if (listen_fd < 0) {
+		printf("Unable to listen on %s: %s\n", name, strerror(-listen_fd));
+		return listen_fd;
+	}
+
+	for (;;) {
+		printf("Waiting for a client on %s\n", name);
+
+		ret = local_accept(listen_fd, nb_streams, &ep0_fd, ep_fds);
+		if (ret == -EINTR) {
+			ret = 0;
+			break;
+		}
+
+		/* e.g. out of file descriptors, until a client goes away */
+		if (ret) {
+			printf("Unable to accept client: %s\n", strerror(-ret));
+			sleep(1);
+			continue;
+		}
+
+		for (i = 0; i < nb_streams; i++) {
+			streams[i] = *pdata;
+			streams[i].index = i;
+			streams[i].ep0_fd = ep0_fd;
+			streams[i].ep_fd = ep_fds[i];
+
+			jzboot_stream_setup(&streams[i]);
+		}
+
+		ret = jzboot_serve(streams, nb_streams, ep0_fd);
+		if (ret == -EPIPE)
+			jzboot_abort_files(streams, nb_streams);
+
+		for (i = 0; i < nb_streams; i++)
+			jzboot_stream_cleanup(&streams[i]);
+		close(ep0_fd);
+
+		if (ret != -EPIPE)
+			break;
+
+		printf("Client disconnected\n");
+	}
+
+	local_unlisten(listen_fd, addr);
+
+	return ret;
+}
+
+static void usage(void)
+{
+	printf("Usage:\n\n    odbootd [options] <ffs mountpoint> <UDC configfs file> <UDC name>\n"
+	       "    odbootd [options] -L <socket>\n"
+	       "    odbootd [options] -t [<address>:]<port>\n"
+	       "\nOptions:\n"
+	       "    -m <mode>       Receive data with read() (copy), AIO (aio) or\n"
+	       "                    splice() (splice) (default aio)\n"
+	       "    -q <depth>      Number of AIO requests queued per endpoint (1-%u, default %u)\n"
+	       "    -b <KiB>        Size of each read from the endpoints in KiB (1-%u, default %u)\n"
+	       "    -n <streams>    Number of bulk OUT endpoints (1-%u, default %u)\n"
+	       "    -D              Write files with direct I/O, in large aligned chunks\n"
+	       "    -L <socket>     Serve clients on a UNIX socket instead of USB\n"
+	       "    -t <port>       Serve clients over TCP instead of USB (default port %s),\n"
+	       "                    on 127.0.0.1 unless an address is given: 0.0.0.0\n"
+	       "                    or [::] listens on all interfaces\n"
+	       "    -r <dir>        Write the files relative to this directory\n"
+	       "    -T <name>=<dev> Write a file to a block device or UBI volume instead,\n"
+	       "                    e.g. rootfs=/dev/ubi0_1 (can be repeated)\n",
+	       MAX_RX_DEPTH, DEFAULT_RX_DEPTH, MAX_RX_BUF_SIZE / 1024,
+	       DEFAULT_RX_BUF_SIZE / 1024,
+	       MAX_STREAMS, DEFAULT_STREAMS, LOCAL_TCP_PORT);
+}
+
 int main(int argc, char **argv)
 {
-	int ret, ep0_fd, udc_fd;
-	struct pdata pdata;
-	char buf[256];
+	unsigned int i, nb_streams = DEFAULT_STREAMS, nb_opened = 0;
+	int ret, ep0_fd, udc_fd, ep_fds[MAX_STREAMS];
+	struct pdata streams[MAX_STREAMS];
+	const char *local_path = NULL, *tcp_addr = NULL;
+	struct local_addr addr;
+	struct pdata pdata = {
+		.data_fd = -1,
+		.direct_fd = -1,
+		.rx_mode = RX_MODE_AIO,
+		.rx_depth = DEFAULT_RX_DEPTH,
+		.rx_buf_size = DEFAULT_RX_BUF_SIZE,
+	};
+
+	while ((ret = getopt(argc, argv, "m:q:b:n:DL:t:r:T:")) != -1) {
+		switch (ret) {
+		case 'm':
+			if (!strcmp(optarg, "copy")) {
+				pdata.rx_mode = RX_MODE_COPY;
+			} else if (!strcmp(optarg, "aio")) {
+				pdata.rx_mode = RX_MODE_AIO;
+			} else if (!strcmp(optarg, "splice")) {
+				pdata.rx_mode = RX_MODE_SPLICE;
+			} else {
+				usage();
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'q':
+			pdata.rx_depth = strtoul(optarg, NULL, 0);
+			if (pdata.rx_depth < 1 || pdata.rx_depth > MAX_RX_DEPTH) {
+				usage();
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'b':
+			pdata.rx_buf_size = strtoul(optarg, NULL, 0) * 1024;
+			if (!pdata.rx_buf_size ||
+			    pdata.rx_buf_size > MAX_RX_BUF_SIZE) {
+				usage();
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'n':
+			nb_streams = strtoul(optarg, NULL, 0);
+			if (nb_streams < 1 || nb_streams > MAX_STREAMS) {
+				usage();
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'D':
+			pdata.direct = true;
+			break;
+		case 'L':
+			local_path = optarg;
+			break;
+		case 't':
+			tcp_addr = optarg;
+			break;
+		case 'r':
+			root_dir = optarg;
+			break;
+		case 'T':
+			if (jzboot_set_target(optarg)) {
+				usage();
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	argc -= optind - 1;
+	argv += optind - 1;
 
-	if (argc < 4) {
-		printf("Usage:\n\n    odbootd <ffs mountpoint> <UDC configfs file> <UDC name>\n");
+	if ((local_path && tcp_addr) ||
+	    (!local_path && !tcp_addr && argc < 4)) {
+		usage();
 		return EXIT_FAILURE;
 	}
 
-	snprintf(buf, sizeof(buf), "%s/ep0", argv[1]);
-	ep0_fd = open(buf, O_RDWR);
-	if (ep0_fd < 0) {
-		ret = errno;
-		printf("Unable to open ep0: %s\n", strerror(ret));
-		return ret;
+	if (pdata.rx_depth * pdata.rx_buf_size > MAX_RX_QUEUE_SIZE) {
+		fprintf(stderr, "At most %u KiB can be queued per endpoint\n",
+			MAX_RX_QUEUE_SIZE / 1024);
+		return EXIT_FAILURE;
+	}
+
+	if (local_path || tcp_addr) {
+		if (local_path)
+			ret = local_addr_unix(&addr, local_path);
+		else
+			ret = local_addr_tcp(&addr, tcp_addr, true);
+		if (ret) {
+			printf("Invalid address: %s\n", strerror(-ret));
+			return EXIT_FAILURE;
+		}
 	}
 
 	stop_fd = eventfd(0, EFD_NONBLOCK);
 	if (stop_fd == -1) {
-		ret = -errno;
-		printf("Unable to create eventfd: %s\n", strerror(-ret));
-		goto out_close;
+		ret = errno;
+		printf("Unable to create eventfd: %s\n", strerror(ret));
+		return ret;
+	}
+
+	done_fd = eventfd(0, EFD_NONBLOCK);
+	if (done_fd == -1) {
+		ret = errno;
+		printf("Unable to create eventfd: %s\n", strerror(ret));
+		close(stop_fd);
+		return ret;
 	}
 
 	set_handler(SIGHUP, sig_handler);
 	set_handler(SIGPIPE, sig_handler);
 	set_handler(SIGINT, sig_handler);
 	set_handler(SIGTERM, sig_handler);
+	set_handler(SIGUSR1, jzboot_abort_handler);
 
-	ret = write_header(ep0_fd);
-	if (ret < 0) {
-		printf("Unable to write header: %s\n", strerror(-ret));
+	if (local_path || tcp_addr) {
+		ret = jzboot_serve_local(&pdata, nb_streams, &addr,
+					 local_path ? local_path : tcp_addr);
 		goto out_close_eventfd;
 	}
 
-	snprintf(buf, sizeof(buf), "%s/ep1", argv[1]);
-	pdata.ep1_fd = open(buf, O_RDONLY);
-	if (pdata.ep1_fd < 0) {
-		ret = -errno;
-		printf("Unable to open ep1: %s\n", strerror(-ret));
+	transport = &jzboot_ffs_transport;
+
+	ret = jzboot_ffs_open(argv[1], nb_streams, &ep0_fd, ep_fds);
+	if (ret)
 		goto out_close_eventfd;
+
+	pdata.ep0_fd = ep0_fd;
+
+	for (nb_opened = 0; nb_opened < nb_streams; nb_opened++) {
+		streams[nb_opened] = pdata;
+		streams[nb_opened].index = nb_opened;
+		streams[nb_opened].ep_fd = ep_fds[nb_opened];
+
+		jzboot_stream_setup(&streams[nb_opened]);
 	}
 
 	udc_fd = open(argv[2], O_WRONLY | O_TRUNC);
 	if (udc_fd < 0) {
 		ret = -errno;
 		printf("Unable to open UDC: %s\n", strerror(-ret));
-		goto out_close_ep1;
+		goto out_cleanup_streams;
 	}
 
 	write(udc_fd, argv[3], strlen(argv[3]));
 	close(udc_fd);
 
-	for (;;) {
-		struct usb_functionfs_event event;
-		struct pollfd pfd[2];
-		int ret;
-
-		pfd[0].fd = ep0_fd;
-		pfd[0].events = POLLIN;
-		pfd[0].revents = 0;
-		pfd[1].fd = stop_fd;
-		pfd[1].events = POLLIN;
-		pfd[1].revents = 0;
-
-		poll_nointr(pfd, 2);
-
-		if (pfd[1].revents & POLLIN) /* STOP event */
-			break;
-
-		if (pfd[0].revents & POLLIN) {
-			read(ep0_fd, &event, sizeof(event));
-
-			ret = handle_event(&pdata, &event);
-			if (ret) {
-				fprintf(stderr, "Unable to handle event: %s\n", strerror(-ret));
-				break;
-			}
-
-			/* Clear out the errors on ep0 when we close endpoints */
-			read(ep0_fd, NULL, 0);
-		}
-	}
+	ret = jzboot_serve(streams, nb_streams, ep0_fd);
+	if (ret == -EPIPE)
+		ret = 0;
 
-out_close_ep1:
-	close(pdata.ep1_fd);
+out_cleanup_streams:
+	for (i = 0; i < nb_opened; i++)
+		jzboot_stream_cleanup(&streams[i]);
+	close(ep0_fd);
 out_close_eventfd:
+	close(done_fd);
 	close(stop_fd);
-out_close:
-	close(ep0_fd);
 	return -ret;
 }
@@ -0,0 +1,182 @@
+/*
+ * profile - Transfer parameters calibrated per board group and link speed
+ *
+ * The profiles are kept in a text file, one per line:
+ *   <group> <speed> <chunk KiB> <queue depth> <rx buffer KiB> <rx depth> <MB/s>
+ * Lines starting with '#' are ignored.
+ *
+ * Licensed under the GPLv2
+ */
+
+#include "profile.h"
+
+#include <errno.h>
+
+#ifdef _WIN32
+
+int profile_default_path(char *buf, size_t len)
+{
+	return -ENOSYS;
+}
+
+int profile_load(const char *path, const char *group, const char *speed,
+		 struct profile *p)
+{
+	return -ENOENT;
+}
+
+int profile_store(const char *path, const char *group, const char *speed,
+		  const struct profile *p)
+{
+	return -ENOSYS;
+}
+
+#else
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PROFILE_LINE_MAX	256
+
+int profile_default_path(char *buf, size_t len)
+{
+	const char *env;
+
+	if ((env = getenv("XDG_CONFIG_HOME")) && *env)
+		snprintf(buf, len, "%s/odboot/profiles", env);
+	else if ((env = getenv("HOME")) && *env)
+		snprintf(buf, len, "%s/.config/odboot/profiles", env);
+	else
+		return -ENOENT;
+
+	return 0;
+}
+
+/* Parse one line; returns false for comments and malformed lines */
+static bool profile_parse(const char *line, char *group, char *speed,
+			  struct profile *p)
+{
+	unsigned int chunk_kib, rx_buf_kib;
+
+	if (line[0] == '#')
+		return false;
+
+	if (sscanf(line, "%63s %15s %u %u %u %u %lf", group, speed,
+		   &chunk_kib, &p->queue_depth, &rx_buf_kib, &p->rx_depth,
+		   &p->mbps) != 7)
+		return false;
+
+	p->chunk_size = chunk_kib * 1024;
+	p->rx_buf_size = rx_buf_kib * 1024;
+
+	return true;
+}
+
+int profile_load(const char *path, const char *group, const char *speed,
+		 struct profile *p)
+{
+	char line[PROFILE_LINE_MAX], g[64], s[16];
+	struct profile tmp;
+	int ret = -ENOENT;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (profile_parse(line, g, s, &tmp) &&
+		    !strcmp(g, group) && !strcmp(s, speed)) {
+			*p = tmp;
+			ret = 0;
+			break;
+		}
+	}
+
+	fclose(f);
+
+	return ret;
+}
+
+static int mkdir_parents(const char *path)
+{
+	char buf[PROFILE_PATH_MAX], *ptr;
+
+	if (strlen(path) >= sizeof(buf))
+		return -ENAMETOOLONG;
+
+	strcpy(buf, path);
+
+	for (ptr = strchr(buf + 1, '/'); ptr; ptr = strchr(ptr + 1, '/')) {
+		*ptr = '\0';
+		if (mkdir(buf, 0755) < 0 && errno != EEXIST)
+			return -errno;
+		*ptr = '/';
+	}
+
+	return 0;
+}
+
+/*
+ * Rewrite the file with the new line in place of the old one, and rename
+ * it over the original, so that a concurrent reader never sees half of it.
+ */
+int profile_store(const char *path, const char *group, const char *speed,
+		  const struct profile *p)
+{
+	char line[PROFILE_LINE_MAX], tmp_path[PROFILE_PATH_MAX], g[64], s[16];
+	struct profile old;
+	FILE *in, *out;
+	int ret;
+
+	ret = mkdir_parents(path);
+	if (ret)
+		return ret;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid());
+
+	out = fopen(tmp_path, "w");
+	if (!out)
+		return -errno;
+
+	in = fopen(path, "r");
+	if (in) {
+		while (fgets(line, sizeof(line), in)) {
+			if (profile_parse(line, g, s, &old) &&
+			    !strcmp(g, group) && !strcmp(s, speed))
+				continue;
+
+			fputs(line, out);
+		}
+
+		fclose(in);
+	} else {
+		fputs("# Written by odboot-client -K\n"
+		      "# group speed chunk_KiB queue_depth rx_buf_KiB rx_depth MB/s\n",
+		      out);
+	}
+
+	fprintf(out, "%s %s %u %u %u %u %.1f\n", group, speed,
+		p->chunk_size / 1024, p->queue_depth,
+		p->rx_buf_size / 1024, p->rx_depth, p->mbps);
+
+	if (fclose(out)) {
+		ret = -errno;
+		unlink(tmp_path);
+		return ret;
+	}
+
+	if (rename(tmp_path, path) < 0) {
+		ret = -errno;
+		unlink(tmp_path);
+		return ret;
+	}
+
+	return 0;
+}
+
+#endif /* _WIN32 */
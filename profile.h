@@ -0,0 +1,36 @@
+/*
+ * profile - Transfer parameters calibrated per board group and link speed
+ *
+ * Licensed under the GPLv2
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stddef.h>
+
+#define PROFILE_PATH_MAX	512
+
+struct profile {
+	/* Host side: size of each bulk transfer, and number in flight */
+	unsigned int chunk_size, queue_depth;
+
+	/* Device side: size and number of the reads queued by odbootd */
+	unsigned int rx_buf_size, rx_depth;
+
+	/* Throughput measured with these parameters */
+	double mbps;
+};
+
+/* Defaults to $XDG_CONFIG_HOME/odboot/profiles, or ~/.config/odboot/profiles */
+int profile_default_path(char *buf, size_t len);
+
+/* Returns -ENOENT if nothing was calibrated for this group and speed */
+int profile_load(const char *path, const char *group, const char *speed,
+		 struct profile *p);
+
+/* Add or replace the profile of a group and speed */
+int profile_store(const char *path, const char *group, const char *speed,
+		  const struct profile *p);
+
+#endif /* PROFILE_H */
@@ -0,0 +1,313 @@
+/*
+ * trace - Timing of the phases of a flash, in Chrome trace-event format
+ *
+ * The events are kept in memory while flashing, and written out at the
+ * end, so that tracing does not add file I/O to the phases it measures.
+ * The file can be loaded in chrome://tracing or https://ui.perfetto.dev.
+ *
+ * Licensed under the GPLv2
+ */
+
+#include "trace.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TRACE_NAME_MAX		64
+#define TRACE_MAX_CATS		16
+
+enum trace_type {
+	TRACE_PHASE,
+	TRACE_ASYNC,
+	TRACE_THREAD_NAME,
+};
+
+struct trace_event {
+	enum trace_type type;
+	const char *cat;
+	char name[TRACE_NAME_MAX];
+	unsigned int tid;
+	uint64_t start, end, bytes;
+};
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_event *trace_events;
+static size_t trace_nb_events, trace_max_events;
+static unsigned int trace_nb_threads;
+static uint64_t trace_origin;
+static char *trace_path;
+static bool trace_enabled;
+
+static __thread unsigned int trace_tid;
+
+static uint64_t trace_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+int trace_open(const char *path)
+{
+	trace_path = strdup(path);
+	if (!trace_path)
+		return -ENOMEM;
+
+	trace_origin = trace_now();
+	trace_enabled = true;
+
+	return 0;
+}
+
+/* Called with trace_lock held */
+static struct trace_event * trace_add(enum trace_type type)
+{
+	struct trace_event *events, *ev;
+	size_t max;
+
+	if (trace_nb_events == trace_max_events) {
+		max = trace_max_events ? trace_max_events * 2 : 1024;
+
+		events = realloc(trace_events, max * sizeof(*events));
+		if (!events)
+			return NULL;
+
+		trace_events = events;
+		trace_max_events = max;
+	}
+
+	if (!trace_tid)
+		trace_tid = ++trace_nb_threads;
+
+	ev = &trace_events[trace_nb_events++];
+	ev->type = type;
+	ev->tid = trace_tid;
+	ev->cat = "";
+	ev->start = ev->end = ev->bytes = 0;
+
+	return ev;
+}
+
+static void trace_record(enum trace_type type, uint64_t start,
+			 const char *cat, const char *name, uint64_t bytes)
+{
+	uint64_t end = trace_now();
+	struct trace_event *ev;
+
+	pthread_mutex_lock(&trace_lock);
+
+	ev = trace_add(type);
+	if (ev) {
+		ev->cat = cat;
+		ev->start = start;
+		ev->end = end;
+		ev->bytes = bytes;
+		snprintf(ev->name, sizeof(ev->name), "%s", name);
+	}
+
+	pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_thread_name(const char *fmt, ...)
+{
+	struct trace_event *ev;
+	va_list ap;
+
+	if (!trace_enabled)
+		return;
+
+	pthread_mutex_lock(&trace_lock);
+
+	ev = trace_add(TRACE_THREAD_NAME);
+	if (ev) {
+		va_start(ap, fmt);
+		vsnprintf(ev->name, sizeof(ev->name), fmt, ap);
+		va_end(ap);
+	}
+
+	pthread_mutex_unlock(&trace_lock);
+}
+
+uint64_t trace_begin(void)
+{
+	return trace_enabled ? trace_now() : 0;
+}
+
+void trace_end(uint64_t start, const char *cat, const char *name,
+	       uint64_t bytes)
+{
+	if (trace_enabled)
+		trace_record(TRACE_PHASE, start, cat, name, bytes);
+}
+
+void trace_end_async(uint64_t start, const char *cat, const char *name,
+		     uint64_t bytes)
+{
+	if (trace_enabled)
+		trace_record(TRACE_ASYNC, start, cat, name, bytes);
+}
+
+static void trace_write_string(FILE *f, const char *str)
+{
+	fputc('"', f);
+
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			fputc('\\', f);
+
+		if ((unsigned char)*str >= 0x20)
+			fputc(*str, f);
+	}
+
+	fputc('"', f);
+}
+
+static void trace_write_event(FILE *f, const struct trace_event *ev,
+			      const char *ph, uint64_t ts, size_t id)
+{
+	fputs("{\"name\":", f);
+	trace_write_string(f, ev->name);
+	fprintf(f, ",\"cat\":\"%s\",\"ph\":\"%s\",\"pid\":1,\"tid\":%u,"
+		"\"ts\":%.3f", ev->cat, ph, ev->tid,
+		(ts - trace_origin) / 1000.0);
+
+	if (ev->type == TRACE_PHASE)
+		fprintf(f, ",\"dur\":%.3f", (ev->end - ev->start) / 1000.0);
+	else
+		fprintf(f, ",\"id\":%zu", id);
+
+	if (ev->bytes)
+		fprintf(f, ",\"args\":{\"bytes\":%llu}",
+			(unsigned long long)ev->bytes);
+
+	fputs("}", f);
+}
+
+static int trace_write(const char *path)
+{
+	const struct trace_event *ev;
+	bool first = true;
+	size_t i;
+	FILE *f;
+
+	f = fopen(path, "w");
+	if (!f)
+		return -errno;
+
+	fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", f);
+
+	for (i = 0; i < trace_nb_events; i++) {
+		ev = &trace_events[i];
+
+		if (!first)
+			fputs(",\n", f);
+		first = false;
+
+		switch (ev->type) {
+		case TRACE_THREAD_NAME:
+			fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\","
+				"\"pid\":1,\"tid\":%u,\"args\":{\"name\":",
+				ev->tid);
+			trace_write_string(f, ev->name);
+			fputs("}}", f);
+			break;
+		case TRACE_PHASE:
+			trace_write_event(f, ev, "X", ev->start, 0);
+			break;
+		case TRACE_ASYNC:
+			trace_write_event(f, ev, "b", ev->start, i);
+			fputs(",\n", f);
+			trace_write_event(f, ev, "e", ev->end, i);
+			break;
+		}
+	}
+
+	fputs("\n]}\n", f);
+
+	if (fclose(f))
+		return -errno;
+
+	return 0;
+}
+
+/* One line: the time spent in each category of phases, in order */
+static void trace_summary(void)
+{
+	const char *cats[TRACE_MAX_CATS];
+	uint64_t durations[TRACE_MAX_CATS] = { 0 };
+	uint64_t end = trace_now(), async_bytes = 0;
+	unsigned int i, nb_cats = 0;
+	size_t j, nb_async = 0;
+	const struct trace_event *ev;
+
+	for (j = 0; j < trace_nb_events; j++) {
+		ev = &trace_events[j];
+
+		if (ev->type == TRACE_ASYNC) {
+			nb_async++;
+			async_bytes += ev->bytes;
+			continue;
+		}
+
+		if (ev->type != TRACE_PHASE)
+			continue;
+
+		for (i = 0; i < nb_cats; i++) {
+			if (!strcmp(cats[i], ev->cat))
+				break;
+		}
+
+		if (i == nb_cats) {
+			if (nb_cats == TRACE_MAX_CATS)
+				continue;
+			cats[nb_cats++] = ev->cat;
+		}
+
+		durations[i] += ev->end - ev->start;
+	}
+
+	printf("Timing: %.2fs total", (end - trace_origin) / 1e9);
+
+	for (i = 0; i < nb_cats; i++)
+		printf("%s %s %.2fs", i ? "," : ";", cats[i], durations[i] / 1e9);
+
+	printf("; %zu transfers, %.1f MiB\n", nb_async,
+	       async_bytes / (1024.0 * 1024.0));
+}
+
+void trace_close(void)
+{
+	int ret;
+
+	if (!trace_enabled)
+		return;
+
+	trace_enabled = false;
+
+	pthread_mutex_lock(&trace_lock);
+
+	trace_summary();
+
+	ret = trace_write(trace_path);
+	if (ret)
+		fprintf(stderr, "Unable to write trace to %s: %s\n",
+			trace_path, strerror(-ret));
+	else
+		printf("Trace written to %s\n", trace_path);
+
+	free(trace_events);
+	trace_events = NULL;
+	trace_nb_events = trace_max_events = 0;
+
+	pthread_mutex_unlock(&trace_lock);
+
+	free(trace_path);
+}
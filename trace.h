@@ -0,0 +1,36 @@
+/*
+ * trace - Timing of the phases of a flash, in Chrome trace-event format
+ *
+ * Licensed under the GPLv2
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/* Start recording; the events are written to 'path' by trace_close() */
+int trace_open(const char *path);
+
+/* Write the trace file, and print a summary of the time spent per phase */
+void trace_close(void);
+
+/* Name the calling thread in the trace */
+void trace_thread_name(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+
+/* Timestamp in nanoseconds to pass to trace_end(), or 0 when not tracing */
+uint64_t trace_begin(void);
+
+/*
+ * Record a phase of category 'cat' (a string literal) that started at
+ * 'start'. Phases of the same thread nest. 'bytes' is optional.
+ */
+void trace_end(uint64_t start, const char *cat, const char *name,
+	       uint64_t bytes);
+
+/* Same, for transfers that can overlap others on the same thread */
+void trace_end_async(uint64_t start, const char *cat, const char *name,
+		     uint64_t bytes);
+
+#endif /* TRACE_H */